@@ -21,10 +21,12 @@
 #include <linux/pci.h>
 #include <linux/poll.h>
 #include <linux/proc_fs.h>
+#include <linux/rcupdate.h>
 #include <linux/version.h>
 
 #include "bifrost_api.h"
 #include "bifrost_dma.h"
+#include "bifrost_platform.h"
 #include <linux/slab.h>
 /*
  * Define driver information (displayed using modinfo)
@@ -43,7 +45,12 @@
 /*
  * Misc
  */
-#define BIFROST_EVENT_BUFFER_SIZE 20
+#define BIFROST_EVENT_BUFFER_SIZE 32 /* Must be a power of two */
+#define BIFROST_EVENT_QUEUE_MAX_DEPTH 4096
+#define BIFROST_DMA_DONE_HISTORY 16 /* Completed DMA requests kept per handle */
+#define BIFROST_REGB_OPS_MAX 1024 /* Max operations per BIFROST_IOCTL_REGB_OPS */
+#define BIFROST_POSTED_WRITES_MAX 256 /* Posted writes queued per handle */
+#define BIFROST_DMA_BUFFERS_MAX 16 /* Registered DMA buffers per handle */
 
 #define DMA_BUSY_BIT 0
 #define CIRCULAR_BUFFER_SIZE 10
@@ -109,6 +116,19 @@ struct timers {
 	struct timer_list debug;	/* periodic debug timer */
 };
 
+/*
+ * Shadow copy of a range of non-volatile registers, see
+ * BIFROST_IOCTL_SET_REGB_CACHE
+ */
+#define BIFROST_REGB_SHADOW_RANGES 8
+
+struct regb_shadow {
+	u32 offset;		/* First register */
+	u32 count;		/* Number of registers */
+	unsigned long *valid;	/* Register value has been read or written */
+	u32 *value;
+};
+
 /*
  * Device memory representation, used when memory-mapping a PCI BAR to CPU
  * address space, making memory CPU accessible via the readb(), readw(),
@@ -130,17 +150,73 @@ struct device_memory {
 	int (*wr)(void *handle, u32 offset, u32 value);
 	int (*rd)(void *handle, u32 offset, u32 *value);
 	int (*mset)(void *handle, u32 offset, u32 mode);
+	/* Optional, read count registers 'incr' bytes apart (0 = repeat) */
+	int (*rd_range)(void *handle, u32 offset, u32 incr, u32 *values,
+			u32 count);
+	unsigned int stride;	/* Offset distance between registers */
+	bool rd_lockless;	/* rd() is a single access, lock not needed */
+
+	/* Shadow register cache, protected by lock */
+	struct regb_shadow shadow[BIFROST_REGB_SHADOW_RANGES];
+	unsigned int num_shadow;
+	unsigned long shadow_hits;
+	unsigned long shadow_misses;
+	unsigned int mapped;	/* User mmap()s, excludes shadow ranges */
 };
 
 struct bifrost_device;
+struct bifrost_user_handle;
+struct eventfd_ctx;
+
+struct bifrost_posted_write {
+	u32 bar;
+	u32 offset;
+	u32 value;
+};
+
+/*
+ * Event subscription index, one array of subscribed user handles per IRQ
+ * source bit and per (non IRQ, non DMA) event type. Arrays are rebuilt
+ * when a subscription changes and published with RCU, released handles
+ * are NULL:ed in place.
+ */
+#define BIFROST_SUBS_SLOT_WRITE_REGB 32
+#define BIFROST_SUBS_SLOT_READ_REGB 33
+#define BIFROST_SUBS_SLOTS 34
+
+struct bifrost_subscribers {
+	struct rcu_head rcu;
+	unsigned int count;
+	struct bifrost_user_handle *hnd[];
+};
+
+/*
+ * eventfd bindings of a user handle, replaced and published with RCU like
+ * the subscription index.
+ */
+#define BIFROST_EVENTFD_MAX 8
+
+struct bifrost_eventfd_binding {
+	struct eventfd_ctx *ctx;
+	u32 irq_mask;
+	u32 flags;
+};
+
+struct bifrost_eventfds {
+	struct rcu_head rcu;
+	unsigned int count;
+	struct bifrost_eventfd_binding b[];
+};
 
 /*
  * Bifrost device representation
  */
 struct bifrost_device {
 	struct bifrost_info info;
-	struct list_head list;          /* list of user handles open to Bifrost */
-	spinlock_t lock_list;
+	const struct bifrost_platform *platform;
+	struct list_head list;          /* list of user handles open to Bifrost (RCU) */
+	struct mutex lock_list;         /* serializes list and index updates */
+	struct bifrost_subscribers __rcu *subs[BIFROST_SUBS_SLOTS];
 	struct bifrost_stats stats;     /* driver statistics */
 	int cdev_initialized;           /* set when cdev has been initialized */
 	struct cdev cdev;               /* char device structure */
@@ -150,6 +226,7 @@ struct bifrost_device {
 	struct timers timers;           /* timers */
 	struct device_memory regb[6];   /* FPGA register bank (PCIe => max 6 BARs) */
 	struct device_memory *regb_dma; /* BAR used for DMA registers*/
+	spinlock_t dma_chan_lock;       /* DMA channel programming sequence */
 	struct device_memory ddr;       /* FPGA DDR memory */
 
 	struct dma_ctl *dma_ctl;
@@ -161,15 +238,7 @@ struct bifrost_device {
         struct device *dev;
 };
 extern struct bifrost_device *bdev;
-
-/*
- * The bifrost_event struct is exported to user-space, so we need
- * a container for it in kernel-space so we don't pollute it
- */
-struct bifrost_event_cont {
-	struct list_head node;
-	struct bifrost_event event;
-};
+extern struct workqueue_struct *bifrost_dma_wq;
 
 /*
  * User space handle, i.e. someone that have called open(). Allow driver to be opened
@@ -181,11 +250,47 @@ struct bifrost_user_handle {
 	wait_queue_head_t waitq;	  /* wait queue used by poll */
 	u32 event_enable_mask;
 	u32 irq_forwarding_mask;
-	atomic_t use_count;
+	struct bifrost_eventfds __rcu *efds;
+	u32 efd_irq_mask;		  /* Union of IRQ masks in efds */
+	atomic_t use_count;		  /* open file and in-flight DMA */
+
+	/*
+	 * Event ring, allocated with vmalloc_user() so that it can be
+	 * mapped to user space. The spinlock serializes producers and the
+	 * mutex serializes kernel side consumers (ioctl and read), user space
+	 * consumers only touch ring->tail.
+	 */
+	struct bifrost_event_ring *ring;
+	unsigned long ring_len;		  /* Size of ring mapping in bytes */
+	unsigned int ring_mask;		  /* Number of slots - 1 */
+	unsigned int entry_size;	  /* Slot size, v1 or v2 event */
+	u32 ring_head;			  /* Producer index, never read back */
+	int ring_mapped;		  /* Number of user space mappings */
+	u32 ring_claimed;		  /* Slots being copied out by a reader */
+	spinlock_t ring_lock;
+	struct mutex read_lock;
+
+	/* What to do when the event ring is full, see bifrost_api.h */
+	u32 overflow_policy;
+	u32 dropped;
+	u32 coalesced;
 
-	struct list_head event_list;
-	spinlock_t event_list_lock;
-	unsigned int event_list_count;
+	/*
+	 * DMA requests started by this handle, in start order, used to wait
+	 * for a ticket. Completed requests are kept until waited for or
+	 * evicted by newer ones, see BIFROST_DMA_DONE_HISTORY.
+	 */
+	struct list_head dma_reqs;
+	spinlock_t dma_lock;
+
+	/* Posted register writes, NULL unless enabled */
+	struct bifrost_posted_write *posted;
+	unsigned int num_posted;
+	struct mutex posted_lock;
+
+	/* Registered DMA buffers, the index is the buffer id */
+	struct dma_reg_buffer *dma_bufs[BIFROST_DMA_BUFFERS_MAX];
+	struct mutex dma_bufs_lock;
 };
 
 int bifrost_pci_probe_post_init(struct pci_dev *pdev);
@@ -194,14 +299,19 @@ int bifrost_pci_init(struct bifrost_device *bifrost);
 void bifrost_pci_exit(struct bifrost_device *bifrost);
 int bifrost_cdev_init(struct bifrost_device *bifrost);
 void bifrost_cdev_exit(struct bifrost_device *bifrost);
+extern const struct attribute_group bifrost_shadow_group;
 
+void bifrost_get_user_handle(struct bifrost_user_handle *hnd);
+void bifrost_put_user_handle(struct bifrost_user_handle *hnd);
 void bifrost_create_event(struct bifrost_device *bifrost,
 			  struct bifrost_event *event);
-void bifrost_create_event_in_atomic(struct bifrost_device *bifrost,
-				    struct bifrost_event *event);
+void bifrost_create_event_at(struct bifrost_device *bifrost,
+			     struct bifrost_event *event, u64 irq_ns);
 
 int bifrost_attach_msis_to_irq(int hw_irq, struct bifrost_device *bifrost);
 void bifrost_detach_msis(void);
+int bifrost_set_irq_coalesce(unsigned int vec, u32 count, u32 window_us);
+int bifrost_wait_irq(unsigned int vec, u32 timeout_ms, u64 *count, u64 *time);
 int bifrost_dma_init(int hw_irq, struct bifrost_device *bifrost);
 void bifrost_dma_cleanup(struct bifrost_device *bifrost);
 
@@ -213,6 +323,11 @@ int  bifrost_fvd_init(struct bifrost_device *bifrost);
 void bifrost_fvd_exit(struct bifrost_device *bifrost);
 int membus_write_device_memory(void *handle, u32 offset, u32 value);
 int membus_read_device_memory(void *handle, u32 offset, u32 *value);
+int membus_read_range_device_memory(void *handle, u32 offset, u32 incr,
+				    u32 *values, u32 count);
+
+struct dma_buf *bifrost_dmabuf_export(struct bifrost_device *bifrost,
+				      size_t size, u64 *bus_addr);
 
 
 #endif /* BIFROST_H_ */
@@ -66,6 +66,31 @@ struct bifrost_modify {
 	__u32 set;    /* Set these bits (higher prio than clear) */
 };
 
+/*
+ * Used with BIFROST_IOCTL_REGB_OPS. Operations are executed in order, a
+ * modify is done like BIFROST_IOCTL_MODIFY_REGB.
+ */
+#define BIFROST_REGB_OP_READ   0
+#define BIFROST_REGB_OP_WRITE  1
+#define BIFROST_REGB_OP_MODIFY 2
+
+struct bifrost_regb_op {
+	__u32 op;     /* BIFROST_REGB_OP_* */
+	__u32 bar;    /* BAR number */
+	__u32 offset; /* Register offset (within a BAR) */
+	__u32 value;  /* Value to write, or value read/written on return */
+	__u32 clear;  /* Modify: clear these bits */
+	__u32 set;    /* Modify: set these bits (higher prio than clear) */
+};
+
+struct bifrost_regb_ops {
+	unsigned long ops; /*
+			    * User pointer to 'count' number of
+			    * struct bifrost_regb_op
+			    */
+	__u32 count;	   /* In: number of ops, out: number of ops done */
+};
+
 struct bifrost_dma_transfer {
 	/*
 	 * System (CPU) memory address.
@@ -78,6 +103,57 @@ struct bifrost_dma_transfer {
 };
 #define BIFROST_DMA_USER_BUFFER	      (1 << 0) /* buffer is allocated in user space, physical Non-Contiguous */
 
+/*
+ * Used with BIFROST_IOCTL_REGISTER_DMA_BUFFER, a user space buffer that is
+ * pinned and mapped for DMA until unregistered or the file is closed.
+ */
+struct bifrost_dma_buffer {
+	__u64 system; /* User space address, 8 byte aligned */
+	__u32 size;   /* Size of buffer in bytes, multiple of 8 */
+	__u32 id;     /* Out: buffer id */
+};
+
+/* Used with BIFROST_IOCTL_START_DMA_{UP,DOWN}_BUFFER */
+struct bifrost_dma_buffer_transfer {
+	__u32 id;     /* Registered buffer */
+	__u32 offset; /* Offset in buffer, 8 byte aligned */
+	__u32 device; /* Device (e.g. FPGA) memory offset. */
+	__u32 size;   /* Size of transfer in bytes, multiple of 8. */
+};
+
+/*
+ * Used with BIFROST_IOCTL_EXPORT_DMA_BUFFER, a DMA buffer allocated by the
+ * driver and shared as a dma-buf. Map it with mmap() on the fd and bracket
+ * CPU access with DMA_BUF_IOCTL_SYNC.
+ */
+struct bifrost_dmabuf_export {
+	__u32 size;   /* Size in bytes, rounded up to whole pages */
+	__s32 fd;     /* Out: dma-buf file descriptor */
+	__u64 system; /* Out: bus address, for BIFROST_IOCTL_START_DMA_UP/DOWN */
+};
+
+/* Used with BIFROST_IOCTL_IMPORT_DMABUF */
+struct bifrost_dmabuf_import {
+	__s32 fd;     /* dma-buf file descriptor */
+	__u32 id;     /* Out: buffer id, as for registered buffers */
+	__u32 size;   /* Out: size of buffer in bytes */
+};
+
+/* Used with BIFROST_IOCTL_START_DMA_{UP,DOWN}_DMABUF */
+struct bifrost_dmabuf_transfer {
+	__s32 fd;     /* Imported dma-buf */
+	__u32 offset; /* Offset in buffer, 8 byte aligned */
+	__u32 device; /* Device (e.g. FPGA) memory offset. */
+	__u32 size;   /* Size of transfer in bytes, multiple of 8. */
+};
+
+/* Used with BIFROST_IOCTL_WAIT_DMA */
+struct bifrost_dma_wait {
+	__u32 id;	  /* Ticket returned when starting the transfer */
+	__u32 timeout_ms; /* Zero only checks if the transfer is done */
+	__s64 time;	  /* Out: transfer time in ns */
+};
+
 #define BIFROST_EVENT_TYPE_IRQ	      (1 << 0)
 #define BIFROST_EVENT_TYPE_WRITE_REGB (1 << 1)
 #define BIFROST_EVENT_TYPE_READ_REGB  (1 << 2)
@@ -139,6 +215,51 @@ struct bifrost_membus_irqstatus {
 	__u32 value;	     /* FPGA irq status */
 };
 
+/*
+ * Used for BIFROST_EVENT_TYPE_IRQ events from MSI vectors. When interrupt
+ * coalescing is enabled for the vector (see BIFROST_IOCTL_IRQ_COALESCE)
+ * one event represents 'count' interrupts, otherwise 'count' is one.
+ * Timestamps are CLOCK_MONOTONIC in nanoseconds.
+ */
+struct bifrost_irq_count {
+	__u32 irq_source;    /*
+			      * irq_source, note this is needed so we match the
+			      * event struct.
+			      */
+	__u32 count;	     /* Number of interrupts */
+	__u64 first;	     /* Time of first interrupt */
+	__u64 last;	     /* Time of last interrupt */
+};
+
+/*
+ * Used with BIFROST_IOCTL_WAIT_IRQ. Works like reading a UIO device, i.e.
+ * only the occurrence count of the vector is reported, and no event is
+ * created. Pass the count from the previous call to not miss interrupts
+ * that happen in between calls.
+ */
+struct bifrost_irq_wait {
+	__u32 vector;	     /* MSI vector */
+	__u32 timeout_ms;    /* Zero doesn't wait */
+	__u64 count;	     /*
+			      * In: last count seen, zero waits for the next
+			      * interrupt. Out: interrupts since MSIs attached.
+			      */
+	__u64 time;	     /* Out: time of last interrupt, CLOCK_MONOTONIC ns */
+};
+
+/*
+ * Used with BIFROST_IOCTL_POLL_REGB, wait until (register & mask) == value.
+ */
+struct bifrost_regb_poll {
+	__u32 bar;	     /* BAR number */
+	__u32 offset;	     /* Register offset */
+	__u32 mask;
+	__u32 value;
+	__u32 timeout_us;    /* Zero reads once */
+	__u32 result;	     /* Out: last value read */
+	__u64 elapsed_ns;    /* Out: time spent waiting */
+};
+
 /*
  * When using membus irq, the following irq_sources are defined:
  * 0x01: Execute interrupt
@@ -156,6 +277,7 @@ struct bifrost_event {
 		struct bifrost_dma dma;
 		struct bifrost_membus_irqstatus irqstatus;
 		struct bifrost_membus_frame frame;
+		struct bifrost_irq_count irq;
 	} data;
 	struct {
 #if KERNEL_VERSION(5, 10, 0) <= LINUX_VERSION_CODE
@@ -168,6 +290,139 @@ struct bifrost_event {
 	} timestamp;
 };
 
+/*
+ * Event layout versions, see BIFROST_IOCTL_SET_EVENT_VERSION. Version 1 is
+ * struct bifrost_event and the default for a new handle.
+ */
+#define BIFROST_EVENT_VERSION_1 1
+#define BIFROST_EVENT_VERSION_2 2
+
+/*
+ * Version 2 event, struct bifrost_event followed by CLOCK_MONOTONIC
+ * timestamps in nanoseconds. A timestamp that isn't available is zero.
+ */
+struct bifrost_event_v2 {
+	struct bifrost_event event;
+	__u64 irq_ns;	     /* Taken in the interrupt handler */
+	__u64 enqueue_ns;    /* Event queued on this handle */
+	__u64 dequeue_ns;    /* Dequeued by read() or ioctl, not set via mmap */
+};
+
+/*
+ * Per user handle event ring, shared with user space via mmap().
+ *
+ * The mapping starts with this header (one page) followed by 'size' event
+ * slots of 'entry_size' bytes each, the first slot at byte 'offset'. Both
+ * indices are free running, the slot of index i is (i & (size - 1)).
+ *
+ * The driver is the only producer and is the only one to advance 'head'.
+ * A consumer reads the slot at 'tail' after observing 'head' != 'tail'
+ * (load-acquire) and then advances 'tail' (store-release). Events are thus
+ * drained without any system call; poll() only needs to be called when the
+ * ring is empty.
+ *
+ * Only use one consumer per handle, i.e. do not mix reading the mapped ring
+ * with read() or the dequeue ioctls. Events consumed from the mapped ring
+ * do not have timestamp.forwarded set.
+ */
+struct bifrost_event_ring {
+	__u32 size;         /* Number of slots, always a power of two */
+	__u32 entry_size;   /* Size of one slot in bytes */
+	__u32 offset;       /* Byte offset from start of mapping to slot 0 */
+	__u32 mmap_size;    /* Length of the complete mapping in bytes */
+	__u32 dropped;      /* Events dropped due to full ring */
+	__u32 coalesced;    /* Events folded into an already queued event */
+	__u32 reserved0[10];
+	__u32 head;         /* Written by driver */
+	__u32 reserved1[15];
+	__u32 tail;         /* Written by consumer */
+	__u32 reserved2[15];
+};
+
+/*
+ * Used with BIFROST_IOCTL_DEQUEUE_EVENTS to dequeue several events in one
+ * call.
+ */
+struct bifrost_event_batch {
+	unsigned long events; /*
+			       * User pointer to memory that can hold at least
+			       * 'count' number of events of the version set
+			       * for the handle
+			       */
+	__u32 count;	      /* In: max events, out: events dequeued */
+};
+
+/*
+ * Used with BIFROST_IOCTL_BIND_EVENTFD. Each interrupt from a source in
+ * 'irq_mask' (same bits as irq_source) increments the eventfd counter by
+ * one. So does completion of a DMA transfer started on this handle if
+ * BIFROST_EVENTFD_DMA_DONE is set in 'flags'.
+ */
+#define BIFROST_EVENTFD_DMA_DONE (1 << 0)
+
+struct bifrost_eventfd {
+	__s32 fd;
+	__u32 irq_mask;
+	__u32 flags;
+};
+
+/*
+ * Event queue overflow policies, i.e. what to do with a new event when the
+ * queue is full:
+ *
+ * DROP_NEWEST: The new event is dropped (default).
+ * DROP_OLDEST: The oldest queued event is dropped.
+ * COALESCE:    The newest queued event of the same type (and IRQ source)
+ *              among the BIFROST_EVENT_COALESCE_WINDOW newest ones is
+ *              replaced by the new one. If there is none, the oldest of the
+ *              BIFROST_EVENT_COALESCE_WINDOW oldest queued events that isn't
+ *              a DMA completion is dropped. If they are all DMA completions
+ *              the new event is dropped.
+ *
+ * Events that read() or BIFROST_IOCTL_DEQUEUE_EVENTS is copying to user
+ * space are never dropped or replaced, a new event that would touch them
+ * is dropped instead. Events are only removed from the queue once they are
+ * copied, so a failed copy loses none.
+ *
+ * Only DROP_NEWEST is allowed while the event ring is mapped to user space.
+ */
+#define BIFROST_EVENT_COALESCE_WINDOW 8
+
+#define BIFROST_EVENT_OVERFLOW_DROP_NEWEST 0
+#define BIFROST_EVENT_OVERFLOW_DROP_OLDEST 1
+#define BIFROST_EVENT_OVERFLOW_COALESCE    2
+
+struct bifrost_event_queue {
+	__u32 depth;     /* Max number of queued events (power of two) */
+	__u32 policy;    /* Overflow policy, BIFROST_EVENT_OVERFLOW_* */
+	__u32 dropped;   /* Number of dropped events (read only) */
+	__u32 coalesced; /* Number of coalesced events (read only) */
+};
+
+/*
+ * Interrupt coalescing of an MSI vector. Up to 'count' interrupts are folded
+ * into one event, the event is created when 'count' is reached or when
+ * 'window_us' has passed since the first interrupt, whichever comes first.
+ * A count of zero or one disables coalescing.
+ */
+struct bifrost_irq_coalesce {
+	__u32 vector;	     /* MSI vector */
+	__u32 count;	     /* Max number of interrupts per event */
+	__u32 window_us;     /* Max delay of first interrupt, must be > 0 */
+};
+
+/* mmap() offset of the event ring */
+#define BIFROST_MMAP_EVENT_RING 0
+
+/*
+ * mmap() offset of a BAR. The BAR is mapped uncached, read-only or
+ * read/write depending on the access user space has to the BAR. Pages with
+ * the DMA controller registers are always read-only, register writes to
+ * them fail with EACCES.
+ */
+#define BIFROST_MMAP_BAR_SPAN 0x10000000UL
+#define BIFROST_MMAP_BAR(n) (((n) + 1) * BIFROST_MMAP_BAR_SPAN)
+
 /*
  * Bifrost ioctls
  */
@@ -195,6 +450,15 @@ struct bifrost_event {
 #define BIFROST_IOCTL_WRITE_REPEAT_REGB					\
 	_IOWR(BIFROST_IOC_MAGIC, 6, struct bifrost_access_range)
 
+/*
+ * Execute a list of register operations, see struct bifrost_regb_op. All
+ * operations are validated before the first is executed, so nothing is
+ * done if any of them isn't allowed. On failure 'count' is the number of
+ * operations done.
+ */
+#define BIFROST_IOCTL_REGB_OPS						\
+	_IOWR(BIFROST_IOC_MAGIC, 33, struct bifrost_regb_ops)
+
 /*
  * Modify FPGA register, i.e. read register, clear bits, set bits and
  * write new value to register
@@ -236,10 +500,136 @@ struct bifrost_event {
 #define BIFROST_IOCTL_IRQ_FORWARDING		\
 	_IOW(BIFROST_IOC_MAGIC, 21, __u32)
 
-/* Dequeue and read event from event-queue */
+/*
+ * Dequeue and read event from event-queue. Only the struct bifrost_event
+ * part of a version 2 event is returned.
+ */
 #define BIFROST_IOCTL_DEQUEUE_EVENT				\
 	_IOR(BIFROST_IOC_MAGIC, 22, struct bifrost_event)
 
+/*
+ * Get geometry of the event ring, i.e. a copy of the ring header, used to
+ * know how much to mmap()
+ */
+#define BIFROST_IOCTL_EVENT_RING_INFO				\
+	_IOR(BIFROST_IOC_MAGIC, 23, struct bifrost_event_ring)
+
+/*
+ * Dequeue as many events as available, up to batch.count. Never blocks,
+ * batch.count is set to zero if the queue is empty. Events can also be
+ * dequeued with read(), which returns whole event records and blocks unless
+ * the device is opened with O_NONBLOCK.
+ */
+#define BIFROST_IOCTL_DEQUEUE_EVENTS				\
+	_IOWR(BIFROST_IOC_MAGIC, 24, struct bifrost_event_batch)
+
+/*
+ * Set event queue depth and overflow policy, a depth of zero keeps the
+ * current depth. Queued events are kept when resizing, which is not
+ * possible while the event ring is mapped. Returns the resulting
+ * settings and counters.
+ */
+#define BIFROST_IOCTL_SET_EVENT_QUEUE				\
+	_IOWR(BIFROST_IOC_MAGIC, 25, struct bifrost_event_queue)
+
+/* Get event queue settings and counters */
+#define BIFROST_IOCTL_GET_EVENT_QUEUE				\
+	_IOR(BIFROST_IOC_MAGIC, 26, struct bifrost_event_queue)
+
+/* Set interrupt coalescing of an MSI vector, affects all users */
+#define BIFROST_IOCTL_IRQ_COALESCE				\
+	_IOW(BIFROST_IOC_MAGIC, 27, struct bifrost_irq_coalesce)
+
+/*
+ * Set event layout version (BIFROST_EVENT_VERSION_*) of this handle, i.e.
+ * what read(), BIFROST_IOCTL_DEQUEUE_EVENTS and the mapped event ring
+ * return. Queued events are converted, not possible while the event ring
+ * is mapped.
+ */
+#define BIFROST_IOCTL_SET_EVENT_VERSION				\
+	_IOW(BIFROST_IOC_MAGIC, 28, __u32)
+
+/*
+ * Bind an eventfd to IRQ sources and/or DMA completions of this handle,
+ * binding an already bound eventfd replaces its sources. Events signalled
+ * through an eventfd are not queued on the handle.
+ */
+#define BIFROST_IOCTL_BIND_EVENTFD				\
+	_IOW(BIFROST_IOC_MAGIC, 29, struct bifrost_eventfd)
+
+/* Remove binding of an eventfd (the file descriptor is the argument) */
+#define BIFROST_IOCTL_UNBIND_EVENTFD				\
+	_IOW(BIFROST_IOC_MAGIC, 30, __s32)
+
+/*
+ * Wait for a DMA transfer started on this handle to complete. Fails with
+ * ETIMEDOUT on timeout and with ENOENT if the ticket is unknown, or
+ * completed long ago, or already waited for. Doesn't consume any DMA done
+ * event.
+ */
+#define BIFROST_IOCTL_WAIT_DMA					\
+	_IOWR(BIFROST_IOC_MAGIC, 31, struct bifrost_dma_wait)
+
+/*
+ * Wait for an interrupt on an MSI vector, fails with ETIMEDOUT on timeout.
+ * Independent of events and IRQ forwarding.
+ */
+#define BIFROST_IOCTL_WAIT_IRQ					\
+	_IOWR(BIFROST_IOC_MAGIC, 32, struct bifrost_irq_wait)
+
+/*
+ * Poll a register in the driver until a condition is met. Fails with
+ * ETIMEDOUT on timeout and EINTR on signal, result and elapsed_ns are
+ * updated in both cases. Reads always go to the device, also for registers
+ * declared with BIFROST_IOCTL_SET_REGB_CACHE.
+ */
+#define BIFROST_IOCTL_POLL_REGB					\
+	_IOWR(BIFROST_IOC_MAGIC, 37, struct bifrost_regb_poll)
+
+/* Pin and map a user space buffer for DMA, returns id in argument */
+#define BIFROST_IOCTL_REGISTER_DMA_BUFFER			\
+	_IOWR(BIFROST_IOC_MAGIC, 38, struct bifrost_dma_buffer)
+
+/* Release a registered buffer, transfers in flight keep it until done */
+#define BIFROST_IOCTL_UNREGISTER_DMA_BUFFER			\
+	_IOW(BIFROST_IOC_MAGIC, 39, __u32)
+
+/*
+ * Start DMA transfer to (up) or from (down) a registered buffer, returns
+ * the ticket like BIFROST_IOCTL_START_DMA_UP. The buffer is synced for the
+ * CPU before DMA done is signalled.
+ */
+#define BIFROST_IOCTL_START_DMA_UP_BUFFER			\
+	_IOW(BIFROST_IOC_MAGIC, 40, struct bifrost_dma_buffer_transfer)
+#define BIFROST_IOCTL_START_DMA_DOWN_BUFFER			\
+	_IOW(BIFROST_IOC_MAGIC, 41, struct bifrost_dma_buffer_transfer)
+
+/*
+ * Allocate a DMA buffer and export it as a dma-buf. The buffer lives until
+ * the last fd and importer has released it, also after closing bifrost.
+ */
+#define BIFROST_IOCTL_EXPORT_DMA_BUFFER				\
+	_IOWR(BIFROST_IOC_MAGIC, 42, struct bifrost_dmabuf_export)
+
+/*
+ * Attach and map a dma-buf of another driver as DMA source/target. The
+ * attachment is kept by the handle until BIFROST_IOCTL_UNREGISTER_DMA_BUFFER
+ * of the id or close. CPU access must be synced with DMA_BUF_IOCTL_SYNC.
+ * Fails with EINVAL if a mapped segment is not 8 byte aligned in address
+ * and length.
+ */
+#define BIFROST_IOCTL_IMPORT_DMABUF				\
+	_IOWR(BIFROST_IOC_MAGIC, 43, struct bifrost_dmabuf_import)
+
+/*
+ * Start DMA transfer to (up) or from (down) an imported dma-buf, returns
+ * the ticket like BIFROST_IOCTL_START_DMA_UP
+ */
+#define BIFROST_IOCTL_START_DMA_UP_DMABUF			\
+	_IOW(BIFROST_IOC_MAGIC, 44, struct bifrost_dmabuf_transfer)
+#define BIFROST_IOCTL_START_DMA_DOWN_DMABUF			\
+	_IOW(BIFROST_IOC_MAGIC, 45, struct bifrost_dmabuf_transfer)
+
 /*
  * By default, all registers are read/writable and does not trigger
  * any events.
@@ -253,6 +643,42 @@ struct bifrost_event {
 #define BIFROST_IOCTL_SET_REGB_MODE				\
 	_IOW(BIFROST_IOC_MAGIC, 52, struct bifrost_access)
 
+/*
+ * Declare 'count' registers from 'offset' of a BAR non-volatile, i.e. only
+ * changed by writes through this driver. Reads and modifies of them are
+ * then served from a shadow copy in the driver, writes still go to the
+ * device. Range reads always read the device. A count of zero removes all
+ * cached ranges of the BAR.
+ *
+ * Fails with EBUSY on the DMA BAR and on a BAR that is mapped with mmap(),
+ * both are written around the cache. Mapping a BAR with cached ranges
+ * fails with EBUSY as well.
+ */
+struct bifrost_regb_cache {
+	__u32 bar;    /* BAR number */
+	__u32 offset; /* First register */
+	__u32 count;  /* Number of registers */
+};
+
+#define BIFROST_IOCTL_SET_REGB_CACHE				\
+	_IOW(BIFROST_IOC_MAGIC, 34, struct bifrost_regb_cache)
+
+/*
+ * Enable (1) or disable (0) posted register writes on this handle. When
+ * enabled, BIFROST_IOCTL_WRITE_REGB only checks access and queues the
+ * write. Queued writes are done in order on BIFROST_IOCTL_WRITE_FENCE,
+ * before any other register access or DMA start on this handle, when the
+ * queue is full, when disabling and on close. A failing queued write is
+ * reported by the ioctl that flushes it. Posted writes are not ordered
+ * against other handles or BARs mapped with mmap().
+ */
+#define BIFROST_IOCTL_POSTED_WRITES				\
+	_IOW(BIFROST_IOC_MAGIC, 35, __u32)
+
+/* Do all queued posted writes of this handle */
+#define BIFROST_IOCTL_WRITE_FENCE				\
+	_IO(BIFROST_IOC_MAGIC, 36)
+
 #define BIFROST_IOCTL_RESET_DMA			\
 	_IO(BIFROST_IOC_MAGIC, 53)
 
@@ -11,7 +11,15 @@
  */
 
 #include <linux/module.h>
+#include <linux/delay.h>
+#include <linux/dma-buf.h>
+#include <linux/eventfd.h>
+#include <linux/file.h>
 #include <linux/jiffies.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/rculist.h>
+#include <linux/vmalloc.h>
 
 #include "bifrost.h"
 #include "bifrost_dma.h"
@@ -20,7 +28,14 @@
 #include "bifrost_platform.h"
 
 static const struct file_operations bifrost_fops;
+static void free_dma_buffers(struct bifrost_user_handle *hnd);
+static void free_regb_shadows(struct regb_shadow *shadow, unsigned int num);
+static int flush_posted_writes(struct bifrost_user_handle *hnd);
 static dev_t bifrost_dev_no;
+
+/* User buffer DMA transfers started and not yet done, see bifrost_cdev_exit */
+static atomic_t user_dma_pending = ATOMIC_INIT(0);
+static DECLARE_WAIT_QUEUE_HEAD(user_dma_idle);
 static struct {
 	int size;
 	int phy;
@@ -74,18 +89,33 @@ int bifrost_cdev_init(struct bifrost_device *bifrost)
 }
 
 /**
- * Clean up character device parts from driver
+ * Clean up character device parts from driver. Waits for user buffer DMA
+ * still in flight, which may outlive the file handle that started it, while
+ * DMA channels and IRQs are still up.
  *
  * @param dev The handle to bifrost device instance.
  */
 void __exit bifrost_cdev_exit(struct bifrost_device *bifrost)
 {
 	struct pci_dev *pcd_dev = bifrost->pdev;
+	int n;
 
 	INFO("cdev_initialized=%d\n", bifrost->cdev_initialized);
 	if (bifrost->cdev_initialized == 0)
 		return;
 
+	if (wait_event_timeout(user_dma_idle,
+			       atomic_read(&user_dma_pending) == 0,
+			       msecs_to_jiffies(1000)) == 0)
+		ALERT("%d user DMA transfers never finished\n",
+		      atomic_read(&user_dma_pending));
+
+	for (n = 0; n < BIFROST_SUBS_SLOTS; n++)
+		kfree(rcu_dereference_protected(bifrost->subs[n], 1));
+	for (n = 0; n < ARRAY_SIZE(bifrost->regb); n++)
+		free_regb_shadows(bifrost->regb[n].shadow,
+				  bifrost->regb[n].num_shadow);
+
 	if (saved_dma_buf.virt)
 		dma_free_coherent(&pcd_dev->dev, saved_dma_buf.size,
 				  saved_dma_buf.virt, saved_dma_buf.phy);
@@ -97,6 +127,588 @@ void __exit bifrost_cdev_exit(struct bifrost_device *bifrost)
 	unregister_chrdev_region(bifrost_dev_no, 1);
 }
 
+/**
+ * Allocate an event ring. The ring header occupies the first page, followed
+ * by the event slots. The memory is zeroed and can be mapped to user space.
+ *
+ * @param size Number of event slots, must be a power of two.
+ * @param entry_size Size of one slot, i.e. size of v1 or v2 event.
+ * @param len Returns size of ring in bytes.
+ * @return ring or NULL.
+ */
+static struct bifrost_event_ring *alloc_event_ring(unsigned int size,
+						   unsigned int entry_size,
+						   unsigned long *len)
+{
+	struct bifrost_event_ring *ring;
+
+	*len = PAGE_ALIGN(PAGE_SIZE + size * entry_size);
+	ring = vmalloc_user(*len);
+	if (ring == NULL)
+		return NULL;
+
+	ring->size = size;
+	ring->entry_size = entry_size;
+	ring->offset = PAGE_SIZE;
+	ring->mmap_size = *len;
+
+	return ring;
+}
+
+/*
+ * Note: the ring header is writable from user space, so never use the
+ * geometry stored in it, only the copy kept in the user handle.
+ */
+static inline struct bifrost_event *ring_slot(struct bifrost_user_handle *h,
+					      u32 index)
+{
+	return (void *)h->ring + PAGE_SIZE +
+		(index & h->ring_mask) * h->entry_size;
+}
+
+/* Requires that the ring lock is held */
+static inline u32 __ring_tail(struct bifrost_user_handle *h)
+{
+	u32 tail = READ_ONCE(h->ring->tail);
+
+	if (h->ring_head - tail > h->ring_mask + 1)
+		tail = h->ring_head - (h->ring_mask + 1); /* garbled by user */
+	return tail;
+}
+
+static bool ring_empty(struct bifrost_user_handle *h)
+{
+	bool empty;
+
+	spin_lock_irq(&h->ring_lock);
+	empty = (READ_ONCE(h->ring->tail) == h->ring_head);
+	spin_unlock_irq(&h->ring_lock);
+
+	return empty;
+}
+
+/**
+ * Resize the event ring of a user handle. Queued events are kept, if they
+ * don't fit the oldest ones are dropped. Events are truncated or zero
+ * extended when the entry size changes. Not possible while the ring is
+ * mapped to user space.
+ *
+ * @param h The user handle.
+ * @param size New number of event slots, must be a power of two.
+ * @param entry_size New slot size.
+ * @return 0 on success.
+ */
+static int resize_event_ring(struct bifrost_user_handle *h, unsigned int size,
+			     unsigned int entry_size)
+{
+	struct bifrost_event_ring *ring, *old;
+	unsigned long len;
+	u32 head, tail, n, i;
+
+	ring = alloc_event_ring(size, entry_size, &len);
+	if (ring == NULL)
+		return -ENOMEM;
+
+	mutex_lock(&h->read_lock);
+	spin_lock_irq(&h->ring_lock);
+	if (h->ring_mapped) {
+		spin_unlock_irq(&h->ring_lock);
+		mutex_unlock(&h->read_lock);
+		vfree(ring);
+		return -EBUSY;
+	}
+
+	head = h->ring_head;
+	tail = __ring_tail(h);
+	n = head - tail;
+	if (n > size) {
+		h->dropped += n - size;
+		tail = head - size;
+		n = size;
+	}
+	for (i = 0; i < n; i++)
+		memcpy((void *)ring + PAGE_SIZE + i * entry_size,
+		       ring_slot(h, tail + i), min(entry_size, h->entry_size));
+
+	ring->head = n;
+	ring->dropped = h->dropped;
+	ring->coalesced = h->coalesced;
+	old = h->ring;
+	h->ring = ring;
+	h->ring_len = len;
+	h->ring_mask = size - 1;
+	h->entry_size = entry_size;
+	h->ring_head = n;
+	spin_unlock_irq(&h->ring_lock);
+	mutex_unlock(&h->read_lock);
+
+	vfree(old);
+	return 0;
+}
+
+/**
+ * Set depth and overflow policy of the event queue of a user handle.
+ *
+ * @param h The user handle.
+ * @param depth Number of events, rounded up to a power of two. Zero keeps
+ *		the current depth.
+ * @param policy One of BIFROST_EVENT_OVERFLOW_*.
+ * @return 0 on success.
+ */
+static int set_event_queue(struct bifrost_user_handle *h, u32 depth,
+			   u32 policy)
+{
+	int rc;
+
+	if (policy > BIFROST_EVENT_OVERFLOW_COALESCE)
+		return -EINVAL;
+	if (depth > BIFROST_EVENT_QUEUE_MAX_DEPTH)
+		return -EINVAL;
+
+	if (depth) {
+		depth = roundup_pow_of_two(max_t(u32, depth, 2));
+		if (depth != h->ring_mask + 1) {
+			rc = resize_event_ring(h, depth, h->entry_size);
+			if (rc)
+				return rc;
+		}
+	}
+
+	spin_lock_irq(&h->ring_lock);
+	if (h->ring_mapped && policy != BIFROST_EVENT_OVERFLOW_DROP_NEWEST) {
+		spin_unlock_irq(&h->ring_lock);
+		return -EBUSY;
+	}
+	h->overflow_policy = policy;
+	spin_unlock_irq(&h->ring_lock);
+
+	return 0;
+}
+
+/**
+ * Set event layout version of a user handle.
+ *
+ * @param h The user handle.
+ * @param version One of BIFROST_EVENT_VERSION_*.
+ * @return 0 on success.
+ */
+static int set_event_version(struct bifrost_user_handle *h, u32 version)
+{
+	unsigned int entry_size;
+
+	switch (version) {
+	case BIFROST_EVENT_VERSION_1:
+		entry_size = sizeof(struct bifrost_event);
+		break;
+	case BIFROST_EVENT_VERSION_2:
+		entry_size = sizeof(struct bifrost_event_v2);
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	if (entry_size == h->entry_size)
+		return 0;
+
+	return resize_event_ring(h, h->ring_mask + 1, entry_size);
+}
+
+static bool subscribes_to(struct bifrost_user_handle *h, int slot)
+{
+	switch (slot) {
+	case BIFROST_SUBS_SLOT_WRITE_REGB:
+		return h->event_enable_mask & BIFROST_EVENT_TYPE_WRITE_REGB;
+	case BIFROST_SUBS_SLOT_READ_REGB:
+		return h->event_enable_mask & BIFROST_EVENT_TYPE_READ_REGB;
+	}
+	if (h->efd_irq_mask & (1U << slot))
+		return true;
+	return (h->event_enable_mask & BIFROST_EVENT_TYPE_IRQ) &&
+		(h->irq_forwarding_mask & (1U << slot));
+}
+
+/* Index slot of an event, or -1 if all handles must be visited */
+static int event_slot(struct bifrost_event *e)
+{
+	switch (e->type) {
+	case BIFROST_EVENT_TYPE_IRQ:
+		if (hweight32(e->data.irq_source) != 1)
+			return -1;
+		return ffs(e->data.irq_source) - 1;
+	case BIFROST_EVENT_TYPE_WRITE_REGB:
+		return BIFROST_SUBS_SLOT_WRITE_REGB;
+	case BIFROST_EVENT_TYPE_READ_REGB:
+		return BIFROST_SUBS_SLOT_READ_REGB;
+	}
+	return -1;
+}
+
+/**
+ * Rebuild the event subscription index from the event masks of all open
+ * user handles. Either all or no slots are updated.
+ *
+ * Requires that lock_list is held.
+ *
+ * @param bifrost The device handle.
+ * @return 0 on success.
+ */
+static int update_subscribers(struct bifrost_device *bifrost)
+{
+	struct bifrost_subscribers *subs[BIFROST_SUBS_SLOTS], *old;
+	struct bifrost_user_handle *h;
+	unsigned int n;
+	int slot;
+
+	for (slot = 0; slot < BIFROST_SUBS_SLOTS; slot++) {
+		n = 0;
+		list_for_each_entry(h, &bifrost->list, node)
+			n += subscribes_to(h, slot);
+
+		subs[slot] = NULL;
+		if (n == 0)
+			continue;
+		subs[slot] = kmalloc(sizeof(*subs[slot]) + n * sizeof(h), GFP_KERNEL);
+		if (subs[slot] == NULL)
+			goto e_nomem;
+		subs[slot]->count = 0;
+		list_for_each_entry(h, &bifrost->list, node) {
+			if (subscribes_to(h, slot))
+				subs[slot]->hnd[subs[slot]->count++] = h;
+		}
+	}
+
+	for (slot = 0; slot < BIFROST_SUBS_SLOTS; slot++) {
+		old = rcu_dereference_protected(bifrost->subs[slot],
+						lockdep_is_held(&bifrost->lock_list));
+		rcu_assign_pointer(bifrost->subs[slot], subs[slot]);
+		if (old)
+			kfree_rcu(old, rcu);
+	}
+	return 0;
+
+e_nomem:
+	while (slot-- > 0)
+		kfree(subs[slot]);
+	return -ENOMEM;
+}
+
+/*
+ * Remove a user handle from the subscription index without allocating,
+ * readers skip NULL entries. Requires that lock_list is held.
+ */
+static void remove_subscriber(struct bifrost_device *bifrost,
+			      struct bifrost_user_handle *hnd)
+{
+	struct bifrost_subscribers *subs;
+	unsigned int n;
+	int slot;
+
+	for (slot = 0; slot < BIFROST_SUBS_SLOTS; slot++) {
+		subs = rcu_dereference_protected(bifrost->subs[slot],
+						 lockdep_is_held(&bifrost->lock_list));
+		for (n = 0; subs && n < subs->count; n++) {
+			if (subs->hnd[n] == hnd)
+				WRITE_ONCE(subs->hnd[n], NULL);
+		}
+	}
+}
+
+/**
+ * Set event enable and IRQ forwarding masks of a user handle and update
+ * the subscription index accordingly.
+ *
+ * @param hnd The user handle.
+ * @param enable_mask New event enable mask.
+ * @param forwarding_mask New IRQ forwarding mask.
+ * @return 0 on success.
+ */
+static int set_event_masks(struct bifrost_user_handle *hnd, u32 enable_mask,
+			   u32 forwarding_mask)
+{
+	struct bifrost_device *bifrost = hnd->bifrost;
+	u32 old_enable, old_forwarding;
+	int rc;
+
+	mutex_lock(&bifrost->lock_list);
+	old_enable = hnd->event_enable_mask;
+	old_forwarding = hnd->irq_forwarding_mask;
+	hnd->event_enable_mask = enable_mask;
+	hnd->irq_forwarding_mask = forwarding_mask;
+	rc = update_subscribers(bifrost);
+	if (rc) {
+		hnd->event_enable_mask = old_enable;
+		hnd->irq_forwarding_mask = old_forwarding;
+	}
+	mutex_unlock(&bifrost->lock_list);
+
+	return rc;
+}
+
+static u32 eventfds_irq_mask(struct bifrost_eventfds *efds)
+{
+	u32 mask = 0;
+	unsigned int n;
+
+	for (n = 0; efds && n < efds->count; n++)
+		mask |= efds->b[n].irq_mask;
+	return mask;
+}
+
+static void free_eventfds(struct bifrost_eventfds *efds)
+{
+	unsigned int n;
+
+	for (n = 0; efds && n < efds->count; n++)
+		eventfd_ctx_put(efds->b[n].ctx);
+	kfree(efds);
+}
+
+/**
+ * Bind an eventfd to IRQ sources and/or DMA completions of a user handle,
+ * or change the sources of an already bound eventfd.
+ *
+ * @param hnd The user handle.
+ * @param fd The eventfd.
+ * @param irq_mask IRQ sources, same bits as the IRQ forwarding mask.
+ * @param flags BIFROST_EVENTFD_*.
+ * @return 0 on success.
+ */
+static int bind_eventfd(struct bifrost_user_handle *hnd, int fd, u32 irq_mask,
+			u32 flags)
+{
+	struct bifrost_device *bifrost = hnd->bifrost;
+	struct bifrost_eventfds *efds, *old;
+	struct eventfd_ctx *ctx;
+	unsigned int n, i;
+	u32 old_mask;
+	int rc;
+
+	if (flags & ~BIFROST_EVENTFD_DMA_DONE)
+		return -EINVAL;
+	if (irq_mask == 0 && flags == 0)
+		return -EINVAL;
+
+	ctx = eventfd_ctx_fdget(fd);
+	if (IS_ERR(ctx))
+		return PTR_ERR(ctx);
+
+	mutex_lock(&bifrost->lock_list);
+	old = rcu_dereference_protected(hnd->efds,
+					lockdep_is_held(&bifrost->lock_list));
+	n = old ? old->count : 0;
+	for (i = 0; i < n && old->b[i].ctx != ctx; i++)
+		;
+	if (i == n && n == BIFROST_EVENTFD_MAX) {
+		rc = -ENOSPC;
+		goto out;
+	}
+
+	efds = kmalloc(sizeof(*efds) + (n + 1) * sizeof(efds->b[0]), GFP_KERNEL);
+	if (efds == NULL) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	if (n)
+		memcpy(efds->b, old->b, n * sizeof(efds->b[0]));
+	efds->count = n;
+	if (i == n) {
+		efds->b[i].ctx = ctx;
+		efds->count++;
+	}
+	efds->b[i].irq_mask = irq_mask;
+	efds->b[i].flags = flags;
+
+	old_mask = hnd->efd_irq_mask;
+	hnd->efd_irq_mask = eventfds_irq_mask(efds);
+	rc = update_subscribers(bifrost);
+	if (rc) {
+		hnd->efd_irq_mask = old_mask;
+		kfree(efds);
+		goto out;
+	}
+	rcu_assign_pointer(hnd->efds, efds);
+	if (old)
+		kfree_rcu(old, rcu);
+	if (i == n)
+		ctx = NULL; /* Reference now held by the binding */
+out:
+	mutex_unlock(&bifrost->lock_list);
+	if (ctx)
+		eventfd_ctx_put(ctx);
+
+	return rc;
+}
+
+/**
+ * Remove the binding of an eventfd from a user handle.
+ *
+ * @param hnd The user handle.
+ * @param fd The eventfd.
+ * @return 0 on success.
+ */
+static int unbind_eventfd(struct bifrost_user_handle *hnd, int fd)
+{
+	struct bifrost_device *bifrost = hnd->bifrost;
+	struct bifrost_eventfds *efds = NULL, *old;
+	struct eventfd_ctx *ctx;
+	unsigned int n, i;
+
+	ctx = eventfd_ctx_fdget(fd);
+	if (IS_ERR(ctx))
+		return PTR_ERR(ctx);
+
+	mutex_lock(&bifrost->lock_list);
+	old = rcu_dereference_protected(hnd->efds,
+					lockdep_is_held(&bifrost->lock_list));
+	n = old ? old->count : 0;
+	for (i = 0; i < n && old->b[i].ctx != ctx; i++)
+		;
+	if (i == n) {
+		mutex_unlock(&bifrost->lock_list);
+		eventfd_ctx_put(ctx);
+		return -ENOENT;
+	}
+
+	if (n > 1) {
+		efds = kmalloc(sizeof(*efds) + (n - 1) * sizeof(efds->b[0]),
+			       GFP_KERNEL);
+		if (efds == NULL) {
+			mutex_unlock(&bifrost->lock_list);
+			eventfd_ctx_put(ctx);
+			return -ENOMEM;
+		}
+		memcpy(efds->b, old->b, i * sizeof(efds->b[0]));
+		memcpy(&efds->b[i], &old->b[i + 1],
+		       (n - i - 1) * sizeof(efds->b[0]));
+		efds->count = n - 1;
+	}
+	rcu_assign_pointer(hnd->efds, efds);
+	hnd->efd_irq_mask = eventfds_irq_mask(efds);
+	/* A stale index only means visiting this handle in vain */
+	update_subscribers(bifrost);
+	mutex_unlock(&bifrost->lock_list);
+
+	/* IRQ handlers may still be signalling the removed eventfd */
+	synchronize_rcu();
+	eventfd_ctx_put(old->b[i].ctx);
+	eventfd_ctx_put(ctx);
+	kfree(old);
+
+	return 0;
+}
+
+/* Keep track of DMA request started by a user handle, see wait_dma() */
+static void track_dma_req(struct bifrost_user_handle *hnd, struct dma_req *req)
+{
+	unsigned long flags;
+
+	get_dma_req(req);
+	spin_lock_irqsave(&hnd->dma_lock, flags);
+	list_add_tail(&req->user_node, &hnd->dma_reqs);
+	spin_unlock_irqrestore(&hnd->dma_lock, flags);
+}
+
+/*
+ * Forget about the oldest completed DMA requests of a user handle, keeping
+ * BIFROST_DMA_DONE_HISTORY of them. Called when a request of the handle
+ * is done.
+ */
+static void retire_dma_reqs(struct bifrost_user_handle *hnd)
+{
+	struct dma_req *req, *tmp;
+	unsigned long flags;
+	unsigned int n = 0;
+
+	spin_lock_irqsave(&hnd->dma_lock, flags);
+	list_for_each_entry(req, &hnd->dma_reqs, user_node)
+		n += completion_done(&req->done);
+	list_for_each_entry_safe(req, tmp, &hnd->dma_reqs, user_node) {
+		if (n <= BIFROST_DMA_DONE_HISTORY)
+			break;
+		if (completion_done(&req->done)) {
+			list_del_init(&req->user_node);
+			free_dma_req(req);
+			n--;
+		}
+	}
+	spin_unlock_irqrestore(&hnd->dma_lock, flags);
+}
+
+/**
+ * Wait for a DMA request started by a user handle to complete.
+ *
+ * @param hnd The user handle.
+ * @param ticket Ticket of the request.
+ * @param timeout_ms Max time to wait.
+ * @param time Returns transfer time in ns.
+ * @return 0 on success.
+ */
+static int wait_dma(struct bifrost_user_handle *hnd, unsigned int ticket,
+		    unsigned int timeout_ms, s64 *time)
+{
+	struct dma_req *req, *found = NULL;
+	long rc;
+
+	spin_lock_irq(&hnd->dma_lock);
+	list_for_each_entry(req, &hnd->dma_reqs, user_node) {
+		if (req->ticket == ticket) {
+			found = req;
+			get_dma_req(found);
+			break;
+		}
+	}
+	spin_unlock_irq(&hnd->dma_lock);
+	if (found == NULL)
+		return -ENOENT;
+
+	rc = wait_for_completion_interruptible_timeout(&found->done,
+						msecs_to_jiffies(timeout_ms));
+	if (rc > 0) {
+		*time = found->time;
+		/* Waited for, no need to keep it */
+		spin_lock_irq(&hnd->dma_lock);
+		if (!list_empty(&found->user_node)) {
+			list_del_init(&found->user_node);
+			free_dma_req(found);
+		}
+		spin_unlock_irq(&hnd->dma_lock);
+		rc = 0;
+	} else if (rc == 0) {
+		rc = -ETIMEDOUT;
+	}
+	free_dma_req(found);
+
+	return rc;
+}
+
+void bifrost_get_user_handle(struct bifrost_user_handle *hnd)
+{
+	atomic_inc(&hnd->use_count);
+}
+
+/**
+ * Drop a reference to a user handle, the last one frees it. References are
+ * held by the open file and by in-flight DMA requests, that use the handle
+ * as cookie. May be called from atomic context.
+ *
+ * @param hnd The user handle.
+ */
+void bifrost_put_user_handle(struct bifrost_user_handle *hnd)
+{
+	struct dma_req *req, *tmp;
+
+	if (!atomic_dec_and_test(&hnd->use_count))
+		return;
+
+	/* No DMA in flight, requests left are all done */
+	list_for_each_entry_safe(req, tmp, &hnd->dma_reqs, user_node)
+		free_dma_req(req);
+	free_eventfds(rcu_dereference_protected(hnd->efds, 1));
+	kfree(hnd->posted);
+	vfree(hnd->ring);
+	kfree(hnd);
+}
+
 /**
  * Handler for file operation open().
  *
@@ -122,18 +734,34 @@ static int bifrost_open(struct inode *inode, struct file *file)
 
 	/* initialize struct members */
 	hnd->bifrost = bifrost;
-	INIT_LIST_HEAD(&hnd->event_list);
-	spin_lock_init(&hnd->event_list_lock);
-	hnd->event_list_count = 0;
+	spin_lock_init(&hnd->ring_lock);
+	mutex_init(&hnd->read_lock);
+	spin_lock_init(&hnd->dma_lock);
+	INIT_LIST_HEAD(&hnd->dma_reqs);
+	mutex_init(&hnd->posted_lock);
+	mutex_init(&hnd->dma_bufs_lock);
 	init_waitqueue_head(&hnd->waitq);
+	atomic_set(&hnd->use_count, 1);
+	hnd->overflow_policy = BIFROST_EVENT_OVERFLOW_DROP_NEWEST;
+
+	hnd->entry_size = sizeof(struct bifrost_event);
+	hnd->ring = alloc_event_ring(BIFROST_EVENT_BUFFER_SIZE, hnd->entry_size,
+				     &hnd->ring_len);
+	if (hnd->ring == NULL) {
+		ALERT("Unable to allocate event ring\n");
+		kfree(hnd);
+		return -ENOMEM;
+	}
+	hnd->ring_mask = BIFROST_EVENT_BUFFER_SIZE - 1;
 
 	/*
-	 * Add this handle _first_ to list of user handles. Lock necessary
-	 * since the list may be used by interrupt handler
+	 * Add this handle _first_ to list of user handles. The lock only
+	 * serializes open/release, event delivery walks the list under RCU.
+	 * A new handle has no subscriptions, so the index is left as is.
 	 */
-	spin_lock(&bifrost->lock_list);
-	list_add(&hnd->node, &bifrost->list);
-	spin_unlock(&bifrost->lock_list);
+	mutex_lock(&bifrost->lock_list);
+	list_add_rcu(&hnd->node, &bifrost->list);
+	mutex_unlock(&bifrost->lock_list);
 
 	/* allow access to user handle via file struct data pointer */
 	file->private_data = hnd;
@@ -152,28 +780,26 @@ static int bifrost_release(struct inode *inode, struct file *file)
 {
 	struct bifrost_user_handle *hnd = file->private_data;
 	struct bifrost_device *bifrost = hnd->bifrost;
-	struct bifrost_event_cont *p;
-	struct list_head *pos, *tmp;
 
 	INFO("\n");
 
+	if (flush_posted_writes(hnd) < 0)
+		ALERT("Posted register writes failed\n");
+
 	/*
-	 * Remove this handle from list of user handles. Lock necessary
-	 * since the list may be used by interrupt handler
+	 * Remove this handle from list of user handles and wait for event
+	 * delivery that may still be using it to finish.
 	 */
-	spin_lock(&bifrost->lock_list);
-	list_del(&hnd->node);
-	spin_unlock(&bifrost->lock_list);
+	mutex_lock(&bifrost->lock_list);
+	list_del_rcu(&hnd->node);
+	remove_subscriber(bifrost, hnd);
+	mutex_unlock(&bifrost->lock_list);
+	synchronize_rcu();
 
-	spin_lock(&hnd->event_list_lock);
-	list_for_each_safe(pos, tmp, &hnd->event_list) {
-		p = list_entry(pos, struct bifrost_event_cont, node);
-		list_del(&p->node);
-		kfree(p);
-	}
-	spin_unlock(&hnd->event_list_lock);
+	/* Here, as the last put of a buffer may sleep */
+	free_dma_buffers(hnd);
 
-	kfree(hnd);
+	bifrost_put_user_handle(hnd);
 	return 0;
 }
 
@@ -191,91 +817,424 @@ static unsigned int bifrost_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &hnd->waitq, wait);
 
-	spin_lock(&hnd->event_list_lock);
-	v = list_empty(&hnd->event_list) ? 0 : (POLLIN | POLLRDNORM);
-	spin_unlock(&hnd->event_list_lock);
+	v = ring_empty(hnd) ? 0 : (POLLIN | POLLRDNORM);
 
 	return v;
 }
 
-static struct bifrost_event_cont *dequeue_event(struct bifrost_user_handle *h)
+static void ring_vm_open(struct vm_area_struct *vma)
 {
-	struct bifrost_event_cont *p;
+	struct bifrost_user_handle *hnd = vma->vm_private_data;
 
-	spin_lock(&h->event_list_lock);
-	if (list_empty(&h->event_list)) {
-		spin_unlock(&h->event_list_lock);
-		return NULL;
-	}
-	p = list_first_entry(&h->event_list, struct bifrost_event_cont, node);
-	list_del(&p->node);
-	h->event_list_count--;
-	spin_unlock(&h->event_list_lock);
+	spin_lock_irq(&hnd->ring_lock);
+	hnd->ring_mapped++;
+	spin_unlock_irq(&hnd->ring_lock);
+}
+
+static void ring_vm_close(struct vm_area_struct *vma)
+{
+	struct bifrost_user_handle *hnd = vma->vm_private_data;
 
-	return p;
+	spin_lock_irq(&hnd->ring_lock);
+	hnd->ring_mapped--;
+	spin_unlock_irq(&hnd->ring_lock);
 }
 
-static int enqueue_event(struct bifrost_user_handle *h,
-			 struct bifrost_event_cont *p)
+static const struct vm_operations_struct ring_vm_ops = {
+	.open = ring_vm_open,
+	.close = ring_vm_close,
+};
+
+/**
+ * Map the event ring of a user handle, see struct bifrost_event_ring.
+ *
+ * The mapped ring is a single-producer/single-consumer queue, so it can only
+ * be mapped when the overflow policy is drop-newest, the other policies
+ * let the driver modify already queued events.
+ *
+ * @param hnd The user handle.
+ * @param vma
+ * @return 0 on success.
+ */
+static int mmap_event_ring(struct bifrost_user_handle *hnd,
+			   struct vm_area_struct *vma)
 {
-	spin_lock(&h->event_list_lock);
-	if (h->event_list_count >= BIFROST_EVENT_BUFFER_SIZE) {
-		spin_unlock(&h->event_list_lock);
-		kfree(p);
-		return -ENOSPC;
+	unsigned long len = vma->vm_end - vma->vm_start;
+	void *ring;
+	int rc;
+
+	if (vma->vm_pgoff != (BIFROST_MMAP_EVENT_RING >> PAGE_SHIFT))
+		return -EINVAL;
+	/* Consumer updates tail, a private (COW) mapping would hide that */
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	spin_lock_irq(&hnd->ring_lock);
+	if (len > hnd->ring_len) {
+		spin_unlock_irq(&hnd->ring_lock);
+		return -EINVAL;
+	}
+	if (hnd->overflow_policy != BIFROST_EVENT_OVERFLOW_DROP_NEWEST) {
+		spin_unlock_irq(&hnd->ring_lock);
+		return -EBUSY;
+	}
+	ring = hnd->ring;
+	hnd->ring_mapped++; /* Pins ring, i.e. no resize */
+	spin_unlock_irq(&hnd->ring_lock);
+
+	rc = remap_vmalloc_range(vma, ring, 0);
+	if (rc) {
+		spin_lock_irq(&hnd->ring_lock);
+		hnd->ring_mapped--;
+		spin_unlock_irq(&hnd->ring_lock);
+		return rc;
 	}
-	list_add_tail(&p->node, &h->event_list);
-	h->event_list_count++;
-	spin_unlock(&h->event_list_lock);
 
+	vma->vm_private_data = hnd;
+	vma->vm_ops = &ring_vm_ops;
 	return 0;
 }
 
-static int enqueue_on_this_handle(struct bifrost_user_handle *h,
-				  struct bifrost_event *e)
+static void stamp_forwarded(struct bifrost_event *e)
 {
-	if (!(e->type & h->event_enable_mask))
-		return 0; /* Nothing to do for this user */
+#if KERNEL_VERSION(5, 10, 0) <= LINUX_VERSION_CODE
+	e->timestamp.forwarded = ns_to_kernel_old_timeval(ktime_get_real_ns());
+#else
+	do_gettimeofday(&e->timestamp.forwarded);
+#endif
+}
 
-	if (e->type == BIFROST_EVENT_TYPE_IRQ) {
-		if (!(h->irq_forwarding_mask & e->data.irq_source))
-			return 0; /* Nothing to do for this user */
-	} else if (e->type == BIFROST_EVENT_TYPE_DMA_DONE) {
-		if (h != (void *)(unsigned long)e->data.dma.cookie)
-			return 0; /* Nothing to do for this user */
+/*
+ * Copy up to max events from the event ring to buf, 'size' bytes per event.
+ * Events are truncated or zero extended if size isn't the entry size. The
+ * copied events stay queued but claimed, so the overflow policies leave them
+ * alone, until consume_events() removes them. Requires the read lock.
+ */
+static u32 peek_events(struct bifrost_user_handle *h, void *buf, u32 max,
+		       unsigned int size)
+{
+	unsigned int len;
+	u32 tail, n;
+
+	spin_lock_irq(&h->ring_lock);
+	len = min(size, h->entry_size);
+	tail = __ring_tail(h);
+	for (n = 0; n < max && tail + n != h->ring_head; n++) {
+		memcpy(buf + n * size, ring_slot(h, tail + n), len);
+		if (len < size)
+			memset(buf + n * size + len, 0, size - len);
 	}
+	h->ring_claimed = n;
+	spin_unlock_irq(&h->ring_lock);
 
-	return 1;
+	return n;
 }
 
-static struct bifrost_event_cont *duplicate_event(struct bifrost_event *e,
-						  gfp_t flags)
+/*
+ * Remove the events claimed by peek_events() once they are delivered, or
+ * release the claim (n = 0) leaving them queued. Requires the read lock.
+ */
+static void consume_events(struct bifrost_user_handle *h, u32 n)
 {
-	struct bifrost_event_cont *p;
-
-	p = kmalloc(sizeof(*p), flags);
-	if (p == NULL)
-		return NULL;
-
-	memcpy(&p->event, e, sizeof(*e));
-	return p;
+	spin_lock_irq(&h->ring_lock);
+	smp_store_release(&h->ring->tail, __ring_tail(h) + n);
+	h->ring_claimed = 0;
+	spin_unlock_irq(&h->ring_lock);
+}
+
+#define DEQUEUE_CHUNK 8
+
+/**
+ * Copy up to max events from the event ring to user space.
+ *
+ * @param h The user handle.
+ * @param uevents User space array of events.
+ * @param max Max number of events to copy.
+ * @param size Size of one event in uevents, v1 or v2 event.
+ * @return number of events copied (0 if ring is empty) or negative errno.
+ */
+static int dequeue_events(struct bifrost_user_handle *h, void __user *uevents,
+			  u32 max, unsigned int size)
+{
+	struct bifrost_event_v2 chunk[DEQUEUE_CHUNK];
+	struct bifrost_event_v2 *e;
+	u32 i, cnt, n = 0;
+	u64 now;
+	int rc = 0;
+
+	mutex_lock(&h->read_lock);
+	while (n < max) {
+		cnt = peek_events(h, chunk, min_t(u32, max - n, DEQUEUE_CHUNK),
+				  size);
+		if (cnt == 0)
+			break;
+		now = ktime_get_ns();
+		for (i = 0; i < cnt; i++) {
+			e = (void *)chunk + i * size;
+			stamp_forwarded(&e->event);
+			if (size == sizeof(*e))
+				e->dequeue_ns = now;
+		}
+		if (copy_to_user(uevents + n * size, chunk, cnt * size)) {
+			consume_events(h, 0); /* Leave them for the next read */
+			rc = -EFAULT;
+			break;
+		}
+		consume_events(h, cnt);
+		n += cnt;
+	}
+	mutex_unlock(&h->read_lock);
+
+	return n > 0 ? n : rc;
+}
+
+/**
+ * Handler for file operation read(). Dequeues as many whole events, of the
+ * version set for the handle, as fits in the buffer, blocks until at least
+ * one event is available unless the file is opened with O_NONBLOCK.
+ *
+ * @param file
+ * @param buf User buffer.
+ * @param count Size of user buffer.
+ * @param ppos
+ * @return number of bytes read.
+ */
+static ssize_t bifrost_read(struct file *file, char __user *buf, size_t count,
+			    loff_t *ppos)
+{
+	struct bifrost_user_handle *hnd = file->private_data;
+	unsigned int size = READ_ONCE(hnd->entry_size);
+	size_t max = min_t(size_t, count / size, INT_MAX);
+	int rc;
+
+	hnd->bifrost->stats.reads++;
+
+	if (max == 0)
+		return -EINVAL;
+
+	for (;;) {
+		rc = dequeue_events(hnd, buf, max, size);
+		if (rc != 0)
+			break;
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		rc = wait_event_interruptible(hnd->waitq, !ring_empty(hnd));
+		if (rc)
+			return rc;
+	}
+	if (rc < 0)
+		return rc;
+
+	return rc * size;
+}
+
+/* Events of same source that can be folded into one, DMA done never is */
+static bool same_source(struct bifrost_event *a, struct bifrost_event *b)
+{
+	if (a->type != b->type || a->type == BIFROST_EVENT_TYPE_DMA_DONE)
+		return false;
+	if (a->type == BIFROST_EVENT_TYPE_IRQ)
+		return a->data.irq_source == b->data.irq_source;
+	return true;
+}
+
+/* Write event to slot, requires that the ring lock is held */
+static void __ring_store(struct bifrost_user_handle *h, u32 index,
+			 struct bifrost_event *e, u64 irq_ns)
+{
+	struct bifrost_event_v2 *slot = (void *)ring_slot(h, index);
+
+	memcpy(&slot->event, e, sizeof(*e));
+	if (h->entry_size == sizeof(*slot)) {
+		slot->irq_ns = irq_ns;
+		slot->enqueue_ns = ktime_get_ns();
+		slot->dequeue_ns = 0;
+	}
+}
+
+/*
+ * Make room for one event in a full ring according to the overflow policy.
+ * Returns 0 if there is room for the new event, -EEXIST if it was coalesced
+ * into an already queued event or -ENOSPC if it shall be dropped. Runs in
+ * IRQ context, so COALESCE only looks at BIFROST_EVENT_COALESCE_WINDOW
+ * events at each end of the ring. Events claimed by a reader are never
+ * touched, the new event is dropped instead. Requires that the ring lock is
+ * held.
+ */
+static int __ring_overflow(struct bifrost_user_handle *h,
+			   struct bifrost_event *e, u64 irq_ns)
+{
+	u32 head = h->ring_head;
+	u32 tail = __ring_tail(h) + h->ring_claimed;
+	u32 i, end;
+
+	switch (h->overflow_policy) {
+	case BIFROST_EVENT_OVERFLOW_DROP_OLDEST:
+		if (h->ring_claimed)
+			break;
+		WRITE_ONCE(h->ring->tail, tail + 1);
+		h->dropped++;
+		return 0;
+
+	case BIFROST_EVENT_OVERFLOW_COALESCE:
+		/* Replace newest queued event from same source */
+		end = head - min_t(u32, head - tail,
+				   BIFROST_EVENT_COALESCE_WINDOW);
+		for (i = head; i != end; i--) {
+			if (same_source(ring_slot(h, i - 1), e)) {
+				__ring_store(h, i - 1, e, irq_ns);
+				h->coalesced++;
+				return -EEXIST;
+			}
+		}
+		/*
+		 * Evict oldest event that isn't a DMA completion, the DMA done
+		 * events before it are moved up one slot
+		 */
+		end = tail + min_t(u32, head - tail,
+				   BIFROST_EVENT_COALESCE_WINDOW);
+		for (i = tail; i != end; i++) {
+			if (ring_slot(h, i)->type != BIFROST_EVENT_TYPE_DMA_DONE)
+				break;
+		}
+		if (i == end || h->ring_claimed)
+			break;
+		for (; i != tail; i--)
+			memcpy(ring_slot(h, i), ring_slot(h, i - 1),
+			       h->entry_size);
+		WRITE_ONCE(h->ring->tail, tail + 1);
+		h->dropped++;
+		return 0;
+	}
+
+	h->dropped++;
+	return -ENOSPC;
+}
+
+static int enqueue_event(struct bifrost_user_handle *h,
+			 struct bifrost_event *e, u64 irq_ns)
+{
+	unsigned long flags;
+	u32 head, tail;
+	int rc = 0;
+
+	spin_lock_irqsave(&h->ring_lock, flags);
+	head = h->ring_head;
+	/* Pairs with store-release of tail by consumer, slot is free to use */
+	tail = smp_load_acquire(&h->ring->tail);
+	if (head - tail > h->ring_mask) {
+		rc = __ring_overflow(h, e, irq_ns);
+		WRITE_ONCE(h->ring->dropped, h->dropped);
+		WRITE_ONCE(h->ring->coalesced, h->coalesced);
+		if (rc < 0)
+			goto out;
+	}
+	__ring_store(h, head, e, irq_ns);
+	/* Publish slot content before new head */
+	smp_store_release(&h->ring_head, head + 1);
+	smp_store_release(&h->ring->head, head + 1);
+out:
+	spin_unlock_irqrestore(&h->ring_lock, flags);
+
+	/* A coalesced event still means there is something to read */
+	return rc == -EEXIST ? 0 : rc;
+}
+
+static int enqueue_on_this_handle(struct bifrost_user_handle *h,
+				  struct bifrost_event *e)
+{
+	if (!(e->type & h->event_enable_mask))
+		return 0; /* Nothing to do for this user */
+
+	if (e->type == BIFROST_EVENT_TYPE_IRQ) {
+		if (!(h->irq_forwarding_mask & e->data.irq_source))
+			return 0; /* Nothing to do for this user */
+	} else if (e->type == BIFROST_EVENT_TYPE_DMA_DONE) {
+		if (h != (void *)(unsigned long)e->data.dma.cookie)
+			return 0; /* Nothing to do for this user */
+	}
+
+	return 1;
+}
+
+static inline void signal_eventfd(struct eventfd_ctx *ctx)
+{
+#if KERNEL_VERSION(6, 8, 0) <= LINUX_VERSION_CODE
+	eventfd_signal(ctx);
+#else
+	eventfd_signal(ctx, 1);
+#endif
+}
+
+/* Returns true if the event was signalled through an eventfd instead */
+static bool signal_eventfds(struct bifrost_user_handle *h,
+			    struct bifrost_event *e)
+{
+	struct bifrost_eventfd_binding *b;
+	struct bifrost_eventfds *efds;
+	bool signalled = false;
+	unsigned int n;
+
+	if (!rcu_access_pointer(h->efds))
+		return false;
+
+	rcu_read_lock();
+	efds = rcu_dereference(h->efds);
+	for (n = 0; efds && n < efds->count; n++) {
+		b = &efds->b[n];
+		if ((e->type == BIFROST_EVENT_TYPE_IRQ &&
+		     (b->irq_mask & e->data.irq_source)) ||
+		    (e->type == BIFROST_EVENT_TYPE_DMA_DONE &&
+		     (b->flags & BIFROST_EVENTFD_DMA_DONE))) {
+			signal_eventfd(b->ctx);
+			signalled = true;
+		}
+	}
+	rcu_read_unlock();
+
+	return signalled;
+}
+
+static void deliver_event(struct bifrost_user_handle *hnd,
+			  struct bifrost_event *event, u64 irq_ns)
+{
+	if (signal_eventfds(hnd, event))
+		return;
+
+	if (!enqueue_on_this_handle(hnd, event))
+		return;
+
+	if (enqueue_event(hnd, event, irq_ns) == 0)
+		wake_up_interruptible(&hnd->waitq);
+	else
+		INFO("dropped event type=%d", event->type);
 }
 
 /**
- * Create events to user handle subscribers.
+ * Create events to user handle subscribers. Safe to call from any context,
+ * including hard IRQ, the event is written directly to the event rings of
+ * the subscribers and they are woken up.
+ *
+ * Only the handles subscribing to the event, according to the subscription
+ * index, are visited. DMA done events go straight to the handle that
+ * started the transfer, which also drops the reference the DMA request
+ * held.
  *
  * TODO for read/write REGB events add filter so that producer of event
  * does not receive an event!
  *
  * @param dev The device handle.
  * @param event The event data.
+ * @param irq_ns CLOCK_MONOTONIC time of the interrupt causing the event,
+ *		 returned in version 2 events.
  */
-void bifrost_create_event(struct bifrost_device *bifrost,
-			  struct bifrost_event *event)
+void bifrost_create_event_at(struct bifrost_device *bifrost,
+			     struct bifrost_event *event, u64 irq_ns)
 {
+	struct bifrost_subscribers *subs;
 	struct bifrost_user_handle *hnd;
-	struct list_head *pos, *tmp;
-	struct bifrost_event_cont *p;
+	unsigned int n;
+	int slot;
 
 #if KERNEL_VERSION(5, 10, 0) <= LINUX_VERSION_CODE
 	event->timestamp.received = ns_to_kernel_old_timeval(ktime_get_real_ns());
@@ -283,20 +1242,42 @@ void bifrost_create_event(struct bifrost_device *bifrost,
 	do_gettimeofday(&event->timestamp.received);
 #endif
 
-	spin_lock(&bifrost->lock_list);
-	list_for_each_safe(pos, tmp, &bifrost->list) {
-		hnd = list_entry(pos, struct bifrost_user_handle, node);
-		if (enqueue_on_this_handle(hnd, event)) {
-			p = duplicate_event(event, GFP_ATOMIC);
-			if (p != NULL) {
-				enqueue_event(hnd, p);
-				wake_up_interruptible(&hnd->waitq);
-			} else {
-				ALERT("dropped event type=%d", event->type);
-			}
+	if (event->type == BIFROST_EVENT_TYPE_DMA_DONE) {
+		hnd = (void *)(unsigned long)event->data.dma.cookie;
+		retire_dma_reqs(hnd);
+		deliver_event(hnd, event, irq_ns);
+		bifrost_put_user_handle(hnd);
+		return;
+	}
+
+	/* Handles are freed after a grace period, see bifrost_release() */
+	rcu_read_lock();
+	slot = event_slot(event);
+	if (slot < 0) {
+		list_for_each_entry_rcu(hnd, &bifrost->list, node)
+			deliver_event(hnd, event, irq_ns);
+	} else {
+		subs = rcu_dereference(bifrost->subs[slot]);
+		for (n = 0; subs && n < subs->count; n++) {
+			hnd = READ_ONCE(subs->hnd[n]);
+			if (hnd)
+				deliver_event(hnd, event, irq_ns);
 		}
 	}
-	spin_unlock(&bifrost->lock_list);
+	rcu_read_unlock();
+}
+
+/**
+ * Create events to user handle subscribers, the interrupt time is taken
+ * to be now. See bifrost_create_event_at().
+ *
+ * @param dev The device handle.
+ * @param event The event data.
+ */
+void bifrost_create_event(struct bifrost_device *bifrost,
+			  struct bifrost_event *event)
+{
+	bifrost_create_event_at(bifrost, event, ktime_get_ns());
 }
 
 
@@ -403,200 +1384,1467 @@ e_exit:
 }
 
 
-static int do_dma_start_xfer(struct dma_ctl *ctl,
-			     struct bifrost_dma_transfer *xfer,
-			     int up_down,
-			     void *cookie, int flags)
+static void unpin_user_buffer(struct page **pages, unsigned int n, bool dirty)
 {
-	struct dma_req *req;
-	unsigned int ticket;
-	struct dma_usr_req usr_req;
+#if KERNEL_VERSION(5, 8, 0) <= LINUX_VERSION_CODE
+	unpin_user_pages_dirty_lock(pages, n, dirty);
+#else
+	unsigned int i;
 
-	req = alloc_dma_req(&ticket, cookie, GFP_KERNEL);
-	if (req == NULL)
+	for (i = 0; i < n; i++) {
+		if (dirty)
+			set_page_dirty_lock(pages[i]);
+#if KERNEL_VERSION(5, 6, 0) <= LINUX_VERSION_CODE
+		unpin_user_page(pages[i]);
+#else
+		put_page(pages[i]);
+#endif
+	}
+#endif
+}
+
+static int pin_user_buffer(unsigned long start, unsigned int n, bool write,
+			   struct page **pages)
+{
+#if KERNEL_VERSION(5, 6, 0) <= LINUX_VERSION_CODE
+	return pin_user_pages_fast(start, n, write ? FOLL_WRITE : 0, pages);
+#elif KERNEL_VERSION(5, 2, 0) <= LINUX_VERSION_CODE
+	return get_user_pages_fast(start, n, write ? FOLL_WRITE : 0, pages);
+#else
+	return get_user_pages_fast(start, n, write, pages);
+#endif
+}
+
+/**
+ * Pin the pages of a user space buffer and map them for DMA.
+ *
+ * @param dev The DMA device.
+ * @param u Returns the mapping.
+ * @param addr User space address of buffer.
+ * @param size Size of buffer.
+ * @param dir DMA direction of mapping.
+ * @return 0 on success, -EOPNOTSUPP if the buffer address or size is not
+ * DMA_USER_ALIGN aligned.
+ */
+static int map_user_buffer(struct device *dev, struct dma_user_sg *u,
+			   unsigned long addr, u32 size,
+			   enum dma_data_direction dir)
+{
+	unsigned long first = addr >> PAGE_SHIFT;
+	unsigned long last = (addr + size - 1) >> PAGE_SHIFT;
+	bool write = (dir != DMA_TO_DEVICE);
+	int n, rc;
+
+	if (size == 0)
+		return -EFAULT;
+	/* Each segment must start and end on the DMA engine alignment */
+	if (addr % DMA_USER_ALIGN || size % DMA_USER_ALIGN)
+		return -EOPNOTSUPP;
+
+	memset(u, 0, sizeof(*u));
+	u->dir = dir;
+	u->num_pages = last - first + 1;
+	u->pages = kvmalloc_array(u->num_pages, sizeof(*u->pages), GFP_KERNEL);
+	if (u->pages == NULL)
 		return -ENOMEM;
 
-	if (flags & BIFROST_DMA_USER_BUFFER) //buffer is allocated in user space, physical Non-Contiguous
-		if (prepare_dma_buffer(xfer, req, up_down, &usr_req))
-			return -ENOMEM;
+	n = pin_user_buffer(addr & PAGE_MASK, u->num_pages, write, u->pages);
+	if (n != u->num_pages) {
+		rc = n < 0 ? n : -EFAULT;
+		goto err_pin;
+	}
 
-	switch (up_down) {
-	case BIFROST_DMA_DIRECTION_DOWN: /* system memory -> FPGA memory */
-		req->src = xfer->system;
-		req->dst = xfer->device;
-		req->len = xfer->size;
-		req->dir = VALHALLA_ADDR_DMA_DIR_UP_STRM_DOWN;
-		break;
-	case BIFROST_DMA_DIRECTION_UP: /* FPGA memory -> system memory */
-		req->src = xfer->device;
-		req->dst = xfer->system;
-		req->len = xfer->size;
-		req->dir = VALHALLA_ADDR_DMA_DIR_UP_STRM_UP;
-		break;
-	default:
-		free_dma_req(req);
-		return -EINVAL;
+	rc = sg_alloc_table_from_pages(&u->sgt, u->pages, u->num_pages,
+				       offset_in_page(addr), size, GFP_KERNEL);
+	if (rc)
+		goto err_pin;
+
+	u->nents = dma_map_sg(dev, u->sgt.sgl, u->sgt.nents, u->dir);
+	if (u->nents == 0) {
+		rc = -ENOMEM;
+		goto err_map;
 	}
-	start_dma_xfer(ctl, req);
 
-	if (flags & BIFROST_DMA_USER_BUFFER)
-		if (finish_dma_buffer(&usr_req))
-			return -ETIMEDOUT;
+	return 0;
 
-	return (int)ticket;
+err_map:
+	sg_free_table(&u->sgt);
+err_pin:
+	if (n > 0)
+		unpin_user_buffer(u->pages, n, false);
+	kvfree(u->pages);
+	return rc;
 }
 
-#define NO_ACCESS 0
-#define RD_ACCESS 0x1 /* Read */
-#define WR_ACCESS 0x2 /* Write */
-#define EV_ACCESS 0x4 /* Events */
+static void unmap_user_buffer(struct device *dev, struct dma_user_sg *u)
+{
+	dma_unmap_sg(dev, u->sgt.sgl, u->sgt.nents, u->dir);
+	sg_free_table(&u->sgt);
+	unpin_user_buffer(u->pages, u->num_pages, u->dir != DMA_TO_DEVICE);
+	kvfree(u->pages);
+}
 
-static int check_bar_access(struct bifrost_device *bifrost, int bar, int access,
-			    unsigned int offset)
+/*
+ * Complete a transfer whose completion was left to its cleanup work and
+ * create the DMA done event dma_msi_handler() would have created.
+ */
+static void complete_user_dma(struct dma_req *req)
 {
-	    /* In normal PCI mode, user-space doesn't have write access to BAR0 */
-	const static int user_space_bar_access[6] = {
-		RD_ACCESS | EV_ACCESS,		   /* BAR0 */
-		RD_ACCESS | WR_ACCESS | EV_ACCESS, /* BAR1 */
-		RD_ACCESS | WR_ACCESS | EV_ACCESS, /* BAR2 */
-		RD_ACCESS | WR_ACCESS | EV_ACCESS, /* BAR3 */
-		RD_ACCESS | WR_ACCESS | EV_ACCESS, /* BAR4 */
-		RD_ACCESS | WR_ACCESS | EV_ACCESS, /* BAR5 */
-	};
-
-	const static int user_space_bar_access_fvd[6] = {  /*used for */
-		RD_ACCESS | WR_ACCESS | EV_ACCESS, /* BAR0  fvd registers	*/
-		RD_ACCESS | WR_ACCESS | EV_ACCESS, /* BAR1  ddr memory window	*/
-		0, /* BAR2 */
-		RD_ACCESS | WR_ACCESS | EV_ACCESS, /* BAR3  dma engine control*/
-		0, /* BAR4 */
-		0, /* BAR5 */
-	};
-
-	/* In normal Membus mode, user-space doesn't have access to BAR2-5 */
-	const static int user_space_membus_access[6] = {
-		RD_ACCESS | WR_ACCESS | EV_ACCESS, /* BAR0 */
-		RD_ACCESS | WR_ACCESS | EV_ACCESS, /* BAR1 */
-		0, /* BAR2 */
-		0, /* BAR3 */
-		0, /* BAR4 */
-		0, /* BAR5 */
-	};
-	int v, mask;
+	struct bifrost_user_handle *hnd = req->cookie;
+	struct bifrost_event event;
 
-	if (bar >= ARRAY_SIZE(user_space_bar_access)) {
-		v = -EINVAL;
-		goto e_exit;
+	memset(&event, 0, sizeof(event));
+	event.type = BIFROST_EVENT_TYPE_DMA_DONE;
+	event.data.dma.id = req->ticket;
+	event.data.dma.time = req->time;
+	event.data.dma.cookie = (u64)(unsigned long)hnd;
+
+	/* Puts the handle reference of the transfer */
+	complete_dma_req(req);
+	bifrost_create_event(hnd->bifrost, &event);
+
+	if (atomic_dec_and_test(&user_dma_pending))
+		wake_up(&user_dma_idle);
+}
+
+/* Start a transfer whose cleanup work ends in complete_user_dma() */
+static void start_user_dma(struct dma_ctl *ctl, struct bifrost_user_handle *hnd,
+			   struct dma_req *req, struct dma_req **segs,
+			   unsigned int count)
+{
+	/* Handle (cookie) must outlive request, put when DMA done is created */
+	bifrost_get_user_handle(hnd);
+	atomic_inc(&user_dma_pending);
+	track_dma_req(hnd, req);
+	start_dma_xfer_sg(ctl, req, segs, count);
+}
+
+/*
+ * Unmap a user buffer when its transfer is done and only then complete the
+ * transfer and create the DMA done event, so that user space never sees
+ * the buffer before caches are synced.
+ */
+static void finish_user_buffer(struct work_struct *work)
+{
+	struct dma_user_sg *u = container_of(work, struct dma_user_sg, work);
+	struct dma_req *req = u->req;
+
+	unmap_user_buffer(u->dev, u);
+	kfree(u);
+	complete_user_dma(req);
+}
+
+/**
+ * Start a transfer to or from a user space buffer without bounce buffer.
+ * The buffer is pinned and mapped, and each mapped segment is transferred
+ * with a request of its own. Returns without waiting, the buffer is
+ * unmapped by finish_user_buffer() before DMA done is signalled.
+ *
+ * @param ctl The DMA controller.
+ * @param xfer The transfer, system is a user space address.
+ * @param up_down Transfer direction.
+ * @param hnd The user handle starting the transfer.
+ * @return Ticket, -EOPNOTSUPP if a bounce buffer is needed or negative
+ * errno.
+ */
+static int do_dma_start_sg(struct dma_ctl *ctl,
+			   struct bifrost_dma_transfer *xfer, int up_down,
+			   struct bifrost_user_handle *hnd)
+{
+	struct device *dev = &hnd->bifrost->pdev->dev;
+	struct dma_req *req, **segs;
+	struct scatterlist *sg;
+	struct dma_user_sg *u;
+	unsigned int ticket, seg_ticket;
+	u32 device = xfer->device;
+	int n, rc;
+
+	u = kmalloc(sizeof(*u), GFP_KERNEL);
+	if (u == NULL)
+		return -ENOMEM;
+	rc = map_user_buffer(dev, u, xfer->system, xfer->size,
+			     up_down == BIFROST_DMA_DIRECTION_UP ?
+			     DMA_FROM_DEVICE : DMA_TO_DEVICE);
+	if (rc < 0) {
+		kfree(u);
+		return rc;
 	}
-	if (!bifrost->regb[bar].enabled) {
-		v = -EFAULT; /* BAR is not mapped into memory */
-		goto e_exit;
+
+	rc = -ENOMEM;
+	segs = kcalloc(u->nents, sizeof(*segs), GFP_KERNEL);
+	if (segs == NULL)
+		goto err_segs;
+	req = alloc_dma_req(&ticket, hnd, GFP_KERNEL);
+	if (req == NULL)
+		goto err_req;
+
+	for_each_sg(u->sgt.sgl, sg, u->nents, n) {
+		segs[n] = alloc_dma_req(&seg_ticket, hnd, GFP_KERNEL);
+		if (segs[n] == NULL)
+			goto err_seg;
+		segs[n]->len = sg_dma_len(sg);
+		if (up_down == BIFROST_DMA_DIRECTION_DOWN) {
+			segs[n]->src = sg_dma_address(sg);
+			segs[n]->dst = device;
+			segs[n]->dir = VALHALLA_ADDR_DMA_DIR_UP_STRM_DOWN;
+		} else {
+			segs[n]->src = device;
+			segs[n]->dst = sg_dma_address(sg);
+			segs[n]->dir = VALHALLA_ADDR_DMA_DIR_UP_STRM_UP;
+		}
+		device += sg_dma_len(sg);
 	}
-	if (platform_fvd())
-		mask = (access & user_space_bar_access_fvd[bar]);
-	else if (bifrost->membus)
-		mask = (access & user_space_membus_access[bar]);
+	req->len = xfer->size;
+	req->dir = segs[0]->dir;
+	u->dev = dev;
+	u->req = req;
+	INIT_WORK(&u->work, finish_user_buffer);
+	req->cleanup = &u->work;
+
+	start_user_dma(ctl, hnd, req, segs, u->nents);
+	kfree(segs);
+
+	return (int)ticket;
+
+err_seg:
+	while (n-- > 0)
+		free_dma_req(segs[n]);
+	free_dma_req(req);
+err_req:
+	kfree(segs);
+err_segs:
+	unmap_user_buffer(dev, u);
+	kfree(u);
+	return rc;
+}
+
+static void release_dma_buffer(struct kref *ref)
+{
+	struct dma_reg_buffer *buf = container_of(ref, struct dma_reg_buffer,
+						  ref);
+
+	if (buf->dmabuf)
+		bifrost_dmabuf_unimport(buf);
 	else
-		mask = (access & user_space_bar_access[bar]);
+		unmap_user_buffer(buf->u.dev, &buf->u);
+	kfree(buf);
+}
 
-	if (access != mask) {
-		v = -EACCES; /* User hasn't sufficient access rights */
-		goto e_exit;
+/* Drop a reference to a registered buffer, may sleep */
+static void put_dma_buffer(struct dma_reg_buffer *buf)
+{
+	kref_put(&buf->ref, release_dma_buffer);
+}
+
+/* Give a buffer an id, or drop it if the handle has no free ids */
+static int add_dma_buffer(struct bifrost_user_handle *hnd,
+			  struct dma_reg_buffer *buf)
+{
+	int id;
+
+	mutex_lock(&hnd->dma_bufs_lock);
+	for (id = 0; id < BIFROST_DMA_BUFFERS_MAX; id++) {
+		if (hnd->dma_bufs[id] == NULL) {
+			hnd->dma_bufs[id] = buf;
+			break;
+		}
 	}
-	if (offset >= bifrost->regb[bar].size) {
-		v = -EFAULT; /* Offset is out-of-range */
-		goto e_exit;
+	mutex_unlock(&hnd->dma_bufs_lock);
+	if (id == BIFROST_DMA_BUFFERS_MAX) {
+		put_dma_buffer(buf);
+		return -ENOSPC;
 	}
-	return 0;
 
-e_exit:
-	ALERT("BAR%d not accessible from user-space (errno=%d)\n", bar, v);
-	return v;
+	return id;
 }
 
-static int do_modify_regb(struct bifrost_device *bifrost, int bar, u32 offset,
-			  u32 clear, u32 set, u32 *value)
+/**
+ * Pin and map a user space buffer for DMA in both directions until it is
+ * unregistered.
+ *
+ * @param hnd The user handle.
+ * @param addr User space address of buffer.
+ * @param size Size of buffer.
+ * @return Buffer id or negative errno.
+ */
+static int register_dma_buffer(struct bifrost_user_handle *hnd,
+			       unsigned long addr, u32 size)
 {
-	struct device_memory *mem;
-	int rc;
-	u32 v;
-
-	rc = check_bar_access(bifrost, bar, (RD_ACCESS | WR_ACCESS), offset);
+	struct device *dev = &hnd->bifrost->pdev->dev;
+	struct dma_reg_buffer *buf;
+	struct dma_user_sg u;
+	struct scatterlist *sg;
+	u32 offset = 0;
+	int n, id, rc;
+
+	if (hnd->bifrost->membus)
+		return -EOPNOTSUPP;
+
+	rc = map_user_buffer(dev, &u, addr, size, DMA_BIDIRECTIONAL);
+	if (rc == -EOPNOTSUPP)
+		return -EINVAL; /* Unaligned */
 	if (rc < 0)
 		return rc;
 
-	mem = &bifrost->regb[bar];
+	buf = kzalloc(struct_size(buf, segs, u.nents), GFP_KERNEL);
+	if (buf == NULL) {
+		unmap_user_buffer(dev, &u);
+		return -ENOMEM;
+	}
+	kref_init(&buf->ref);
+	buf->u = u;
+	buf->u.dev = dev;
+	buf->size = size;
+	buf->num_segs = u.nents;
+	for_each_sg(u.sgt.sgl, sg, u.nents, n) {
+		buf->segs[n].offset = offset;
+		buf->segs[n].len = sg_dma_len(sg);
+		buf->segs[n].addr = sg_dma_address(sg);
+		offset += sg_dma_len(sg);
+	}
 
-	/*
-	 * Note: these registers are only accessed from user-space and
-	 *	 never from ISRs etc. so a spin_lock/unlock should be
-	 *	 enough...
-	 */
-	spin_lock(&mem->lock);
-	rc = mem->rd(mem->handle, offset, &v);
-	if (rc < 0)
-		goto e_exit;
-	v = (v & ~clear) | set;
-	rc = mem->wr(mem->handle, offset, v);
-	if (rc < 0)
-		goto e_exit;
-	spin_unlock(&mem->lock);
-	*value = v;
+	return add_dma_buffer(hnd, buf);
+}
+
+static int unregister_dma_buffer(struct bifrost_user_handle *hnd, u32 id)
+{
+	struct dma_reg_buffer *buf = NULL;
+
+	if (id >= BIFROST_DMA_BUFFERS_MAX)
+		return -EINVAL;
+
+	mutex_lock(&hnd->dma_bufs_lock);
+	swap(buf, hnd->dma_bufs[id]);
+	mutex_unlock(&hnd->dma_bufs_lock);
+	if (buf == NULL)
+		return -ENOENT;
+	put_dma_buffer(buf);
+
+	return 0;
+}
+
+/* Release all registered buffers of a user handle, called on close */
+static void free_dma_buffers(struct bifrost_user_handle *hnd)
+{
+	u32 id;
+
+	for (id = 0; id < BIFROST_DMA_BUFFERS_MAX; id++)
+		unregister_dma_buffer(hnd, id);
+}
+
+/* A transfer to or from part of a registered buffer */
+struct dma_buffer_xfer {
+	struct dma_reg_buffer *buf;
+	struct dma_req *req;
+	unsigned int first;	/* First segment */
+	unsigned int count;	/* Number of segments */
+	u32 offset;
+	u32 size;
+	bool up;
+	struct work_struct work;
+};
+
+/* Sync the part of a registered buffer used by a transfer */
+static void sync_dma_buffer(struct dma_buffer_xfer *x, bool for_cpu)
+{
+	struct dma_reg_buffer *buf = x->buf;
+	struct dma_buffer_seg *seg;
+	u32 start, end, n;
+
+	if (buf->dmabuf)
+		return; /* Up to the exporter, see DMA_BUF_IOCTL_SYNC */
+
+	for (n = x->first; n < x->first + x->count; n++) {
+		seg = &buf->segs[n];
+		start = max(x->offset, seg->offset);
+		end = min(x->offset + x->size, seg->offset + seg->len);
+		if (for_cpu)
+			dma_sync_single_for_cpu(buf->u.dev,
+						seg->addr + start - seg->offset,
+						end - start, buf->u.dir);
+		else
+			dma_sync_single_for_device(buf->u.dev,
+						   seg->addr + start - seg->offset,
+						   end - start, buf->u.dir);
+	}
+}
+
+static void finish_buffer_xfer(struct work_struct *work)
+{
+	struct dma_buffer_xfer *x = container_of(work, struct dma_buffer_xfer,
+						 work);
+
+	if (x->up)
+		sync_dma_buffer(x, true);
+	put_dma_buffer(x->buf);
+	complete_user_dma(x->req);
+	kfree(x);
+}
+
+/* Get a reference to a registered buffer by id */
+static struct dma_reg_buffer *get_dma_buffer(struct bifrost_user_handle *hnd,
+					     u32 id)
+{
+	struct dma_reg_buffer *buf = NULL;
+
+	if (id >= BIFROST_DMA_BUFFERS_MAX)
+		return NULL;
+
+	mutex_lock(&hnd->dma_bufs_lock);
+	buf = hnd->dma_bufs[id];
+	if (buf)
+		kref_get(&buf->ref);
+	mutex_unlock(&hnd->dma_bufs_lock);
+
+	return buf;
+}
+
+/* Get a reference to an imported dma-buf by file descriptor */
+static struct dma_reg_buffer *
+get_dma_buffer_fd(struct bifrost_user_handle *hnd, int fd)
+{
+	struct dma_reg_buffer *buf = NULL;
+	struct dma_buf *dmabuf;
+	u32 id;
+
+	dmabuf = dma_buf_get(fd);
+	if (IS_ERR(dmabuf))
+		return NULL;
+
+	mutex_lock(&hnd->dma_bufs_lock);
+	for (id = 0; id < BIFROST_DMA_BUFFERS_MAX; id++) {
+		if (hnd->dma_bufs[id] && hnd->dma_bufs[id]->dmabuf == dmabuf) {
+			buf = hnd->dma_bufs[id];
+			kref_get(&buf->ref);
+			break;
+		}
+	}
+	mutex_unlock(&hnd->dma_bufs_lock);
+	dma_buf_put(dmabuf);
+
+	return buf;
+}
+
+/**
+ * Attach and map an imported dma-buf for DMA until it is unregistered.
+ * Importing the same dma-buf again returns the id it already has.
+ *
+ * @param hnd The user handle.
+ * @param fd File descriptor of dma-buf.
+ * @param size Returns size of mapped buffer.
+ * @param added Returns true if the dma-buf was not imported before.
+ * @return Buffer id or negative errno.
+ */
+static int import_dma_buffer(struct bifrost_user_handle *hnd, int fd,
+			     u32 *size, bool *added)
+{
+	struct dma_reg_buffer *buf;
+	struct dma_buf *dmabuf;
+	int id, free_id = -1;
+
+	if (hnd->bifrost->membus)
+		return -EOPNOTSUPP;
+
+	*added = false;
+	dmabuf = dma_buf_get(fd);
+	if (IS_ERR(dmabuf))
+		return PTR_ERR(dmabuf);
+
+	/* Lookup and insert in one go, or two imports could race */
+	mutex_lock(&hnd->dma_bufs_lock);
+	for (id = 0; id < BIFROST_DMA_BUFFERS_MAX; id++) {
+		buf = hnd->dma_bufs[id];
+		if (buf == NULL && free_id < 0)
+			free_id = id;
+		if (buf && buf->dmabuf == dmabuf) {
+			*size = buf->size;
+			goto out;
+		}
+	}
+
+	id = -ENOSPC;
+	if (free_id < 0)
+		goto out;
+
+	buf = bifrost_dmabuf_import(hnd->bifrost, dmabuf);
+	if (IS_ERR(buf)) {
+		id = PTR_ERR(buf);
+		goto out;
+	}
+	hnd->dma_bufs[free_id] = buf;
+	*size = buf->size;
+	*added = true;
+	id = free_id;
+out:
+	mutex_unlock(&hnd->dma_bufs_lock);
+	dma_buf_put(dmabuf);
+
+	return id;
+}
+
+/**
+ * Start a transfer to or from part of a registered buffer. The buffer is
+ * already mapped, only its segments covering the part are looked up.
+ *
+ * @param ctl The DMA controller.
+ * @param hnd The user handle.
+ * @param buf The buffer, the reference is passed on to the transfer.
+ * @param bx The transfer, id is not used.
+ * @param up_down Transfer direction.
+ * @return Ticket or negative errno.
+ */
+static int do_dma_start_buffer(struct dma_ctl *ctl,
+			       struct bifrost_user_handle *hnd,
+			       struct dma_reg_buffer *buf,
+			       struct bifrost_dma_buffer_transfer *bx,
+			       int up_down)
+{
+	struct dma_buffer_xfer *x;
+	struct dma_buffer_seg *seg;
+	struct dma_req *req, **segs;
+	unsigned int ticket, seg_ticket, lo, hi, n;
+	u32 device = bx->device, start, end;
+	int rc;
+
+	if (buf == NULL)
+		return -ENOENT;
+
+	rc = -EINVAL;
+	if (bx->size == 0 || bx->offset % DMA_USER_ALIGN ||
+	    bx->size % DMA_USER_ALIGN ||
+	    (u64)bx->offset + bx->size > buf->size)
+		goto err_range;
+
+	/* Binary search for the segment holding offset */
+	lo = 0;
+	hi = buf->num_segs;
+	while (hi - lo > 1) {
+		n = (lo + hi) / 2;
+		if (buf->segs[n].offset <= bx->offset)
+			lo = n;
+		else
+			hi = n;
+	}
+
+	rc = -ENOMEM;
+	x = kzalloc(sizeof(*x), GFP_KERNEL);
+	if (x == NULL)
+		goto err_range;
+	x->buf = buf;
+	x->first = lo;
+	x->offset = bx->offset;
+	x->size = bx->size;
+	x->up = (up_down == BIFROST_DMA_DIRECTION_UP);
+	for (n = lo; n < buf->num_segs &&
+	     buf->segs[n].offset < bx->offset + bx->size; n++)
+		x->count++;
+
+	segs = kcalloc(x->count, sizeof(*segs), GFP_KERNEL);
+	if (segs == NULL)
+		goto err_segs;
+	req = alloc_dma_req(&ticket, hnd, GFP_KERNEL);
+	if (req == NULL)
+		goto err_req;
+
+	for (n = 0; n < x->count; n++) {
+		seg = &buf->segs[x->first + n];
+		start = max(x->offset, seg->offset);
+		end = min(x->offset + x->size, seg->offset + seg->len);
+		segs[n] = alloc_dma_req(&seg_ticket, hnd, GFP_KERNEL);
+		if (segs[n] == NULL)
+			goto err_seg;
+		segs[n]->len = end - start;
+		if (x->up) {
+			segs[n]->src = device;
+			segs[n]->dst = seg->addr + start - seg->offset;
+			segs[n]->dir = VALHALLA_ADDR_DMA_DIR_UP_STRM_UP;
+		} else {
+			segs[n]->src = seg->addr + start - seg->offset;
+			segs[n]->dst = device;
+			segs[n]->dir = VALHALLA_ADDR_DMA_DIR_UP_STRM_DOWN;
+		}
+		device += end - start;
+	}
+	req->len = bx->size;
+	req->dir = segs[0]->dir;
+	x->req = req;
+	INIT_WORK(&x->work, finish_buffer_xfer);
+	req->cleanup = &x->work;
+
+	sync_dma_buffer(x, false);
+
+	start_user_dma(ctl, hnd, req, segs, x->count);
+	kfree(segs);
+
+	return (int)ticket;
+
+err_seg:
+	while (n-- > 0)
+		free_dma_req(segs[n]);
+	free_dma_req(req);
+err_req:
+	kfree(segs);
+err_segs:
+	kfree(x);
+err_range:
+	put_dma_buffer(buf);
+	return rc;
+}
+
+static int do_dma_start_xfer(struct dma_ctl *ctl,
+			     struct bifrost_dma_transfer *xfer,
+			     int up_down,
+			     void *cookie, int flags)
+{
+	struct dma_req *req;
+	unsigned int ticket;
+	struct dma_usr_req usr_req;
+	int rc;
+
+	if (flags & BIFROST_DMA_USER_BUFFER) {
+		rc = do_dma_start_sg(ctl, xfer, up_down, cookie);
+		if (rc != -EOPNOTSUPP)
+			return rc;
+		/* Fall back to bounce buffer */
+	}
+
+	req = alloc_dma_req(&ticket, cookie, GFP_KERNEL);
+	if (req == NULL)
+		return -ENOMEM;
+
+	if (flags & BIFROST_DMA_USER_BUFFER) //buffer is allocated in user space, physical Non-Contiguous
+		if (prepare_dma_buffer(xfer, req, up_down, &usr_req)) {
+			free_dma_req(req);
+			return -ENOMEM;
+		}
+
+	switch (up_down) {
+	case BIFROST_DMA_DIRECTION_DOWN: /* system memory -> FPGA memory */
+		req->src = xfer->system;
+		req->dst = xfer->device;
+		req->len = xfer->size;
+		req->dir = VALHALLA_ADDR_DMA_DIR_UP_STRM_DOWN;
+		break;
+	case BIFROST_DMA_DIRECTION_UP: /* FPGA memory -> system memory */
+		req->src = xfer->device;
+		req->dst = xfer->system;
+		req->len = xfer->size;
+		req->dir = VALHALLA_ADDR_DMA_DIR_UP_STRM_UP;
+		break;
+	default:
+		free_dma_req(req);
+		return -EINVAL;
+	}
+
+	/* Handle (cookie) must outlive request, put when DMA done is created */
+	bifrost_get_user_handle(cookie);
+	track_dma_req(cookie, req);
+	start_dma_xfer(ctl, req);
+
+	if (flags & BIFROST_DMA_USER_BUFFER)
+		if (finish_dma_buffer(&usr_req))
+			return -ETIMEDOUT;
+
+	return (int)ticket;
+}
+
+/* Access rights of user-space to a BAR, bar must be valid */
+static int bar_access(struct bifrost_device *bifrost, int bar)
+{
+	return bifrost->platform->bar_access[bar];
+}
+
+/*
+ * True if [offset, offset + len) of a BAR overlaps the DMA controller
+ * registers. The driver programs DMA channels without the BAR lock, so user
+ * space must not write them.
+ */
+static bool is_dma_regs(struct bifrost_device *bifrost, int bar,
+			unsigned long offset, unsigned long len)
+{
+	return &bifrost->regb[bar] == bifrost->regb_dma &&
+		offset < VALHALLA_ADDR_DMA_REG_END &&
+		offset + len > VALHALLA_ADDR_DMA_REG_BASE;
+}
+
+static int check_bar_access(struct bifrost_device *bifrost, int bar, int access,
+			    unsigned int offset)
+{
+	int v, mask;
+
+	if (bar >= ARRAY_SIZE(bifrost->regb)) {
+		v = -EINVAL;
+		goto e_exit;
+	}
+	if (!bifrost->regb[bar].enabled) {
+		v = -EFAULT; /* BAR is not mapped into memory */
+		goto e_exit;
+	}
+	mask = (access & bar_access(bifrost, bar));
+
+	if (access != mask) {
+		v = -EACCES; /* User hasn't sufficient access rights */
+		goto e_exit;
+	}
+	if (offset >= bifrost->regb[bar].size) {
+		v = -EFAULT; /* Offset is out-of-range */
+		goto e_exit;
+	}
+	if ((access & WR_ACCESS) && is_dma_regs(bifrost, bar, offset, 4)) {
+		v = -EACCES; /* DMA controller is driver owned */
+		goto e_exit;
+	}
+	return 0;
+
+e_exit:
+	ALERT("BAR%d not accessible from user-space (errno=%d)\n", bar, v);
+	return v;
+}
+
+/* Requires that the lock of the BAR is held */
+static struct regb_shadow *__find_shadow(struct device_memory *mem,
+					 u32 offset, u32 *index)
+{
+	struct regb_shadow *s;
+	unsigned int n;
+	u32 i;
+
+	for (n = 0; n < mem->num_shadow; n++) {
+		s = &mem->shadow[n];
+		if (offset < s->offset || (offset - s->offset) % mem->stride)
+			continue;
+		i = (offset - s->offset) / mem->stride;
+		if (i < s->count) {
+			*index = i;
+			return s;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Read a register, from the shadow cache if it's a cached register that has
+ * been accessed before. Requires that the lock of the BAR is held.
+ */
+static int __shadow_rd(struct device_memory *mem, u32 offset, u32 *value)
+{
+	struct regb_shadow *s;
+	u32 i;
+	int rc;
+
+	s = __find_shadow(mem, offset, &i);
+	if (s && test_bit(i, s->valid)) {
+		*value = s->value[i];
+		mem->shadow_hits++;
+		return 0;
+	}
+
+	rc = mem->rd(mem->handle, offset, value);
+	if (s) {
+		mem->shadow_misses++;
+		if (rc >= 0) {
+			s->value[i] = *value;
+			__set_bit(i, s->valid);
+		}
+	}
+	return rc;
+}
+
+/* Write a register and its shadow. Requires that the lock of the BAR is held */
+static int __shadow_wr(struct device_memory *mem, u32 offset, u32 value)
+{
+	struct regb_shadow *s;
+	u32 i;
+	int rc;
+
+	rc = mem->wr(mem->handle, offset, value);
+	s = __find_shadow(mem, offset, &i);
+	if (s) {
+		s->value[i] = value;
+		if (rc >= 0)
+			__set_bit(i, s->valid);
+		else
+			__clear_bit(i, s->valid);
+	}
+	return rc;
+}
+
+static void free_regb_shadows(struct regb_shadow *shadow, unsigned int num)
+{
+	unsigned int n;
+
+	for (n = 0; n < num; n++) {
+		kfree(shadow[n].value);
+		kfree(shadow[n].valid);
+	}
+}
+
+/* Shadow register cache hits and misses, one number per BAR */
+static ssize_t show_shadow(char *buf, bool misses)
+{
+	struct device_memory *mem;
+	ssize_t len = 0;
+	int n;
+
+	for (n = 0; n < ARRAY_SIZE(bdev->regb); n++) {
+		mem = &bdev->regb[n];
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%lu%s",
+				 misses ? mem->shadow_misses : mem->shadow_hits,
+				 n < ARRAY_SIZE(bdev->regb) - 1 ? " " : "\n");
+	}
+	return len;
+}
+
+static ssize_t show_shadow_hits(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	return show_shadow(buf, false);
+}
+
+static ssize_t show_shadow_misses(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	return show_shadow(buf, true);
+}
+
+static DEVICE_ATTR(shadow_hits, 0444, show_shadow_hits, NULL);
+static DEVICE_ATTR(shadow_misses, 0444, show_shadow_misses, NULL);
+
+static struct attribute *bifrost_shadow_attrs[] = {
+	&dev_attr_shadow_hits.attr,
+	&dev_attr_shadow_misses.attr,
+	NULL
+};
+
+/* Registered on the PCI device or the membus platform device */
+const struct attribute_group bifrost_shadow_group = {
+	.attrs	= bifrost_shadow_attrs,
+};
+
+/**
+ * Add a range of registers to the shadow cache of a BAR, or remove all
+ * ranges of the BAR. Not allowed on the DMA BAR, which the driver writes
+ * itself, nor on a BAR mapped with mmap().
+ *
+ * @param bifrost The device handle.
+ * @param bar BAR number.
+ * @param offset First register.
+ * @param count Number of registers, zero removes all ranges.
+ * @return 0 on success.
+ */
+static int set_regb_cache(struct bifrost_device *bifrost, int bar, u32 offset,
+			  u32 count)
+{
+	struct regb_shadow old[BIFROST_REGB_SHADOW_RANGES], s, *o;
+	struct device_memory *mem;
+	unsigned int n, num_old;
+	u32 last;
+	int rc;
+
+	rc = check_bar_access(bifrost, bar, RD_ACCESS | WR_ACCESS, offset);
+	if (rc < 0)
+		return rc;
+	mem = &bifrost->regb[bar];
+
+	if (count == 0) {
+		spin_lock(&mem->lock);
+		num_old = mem->num_shadow;
+		memcpy(old, mem->shadow, num_old * sizeof(old[0]));
+		WRITE_ONCE(mem->num_shadow, 0);
+		spin_unlock(&mem->lock);
+		free_regb_shadows(old, num_old);
+		return 0;
+	}
+
+	/* DMA channel start writes that BAR without going through the cache */
+	if (mem == bifrost->regb_dma)
+		return -EBUSY;
+
+	if ((u64)offset + (u64)mem->stride * (count - 1) >= mem->size)
+		return -EFAULT; /* Range is out-of-range */
+	last = offset + mem->stride * (count - 1);
+
+	s.offset = offset;
+	s.count = count;
+	s.value = kcalloc(count, sizeof(u32), GFP_KERNEL);
+	s.valid = kcalloc(BITS_TO_LONGS(count), sizeof(long), GFP_KERNEL);
+	if (s.value == NULL || s.valid == NULL) {
+		free_regb_shadows(&s, 1);
+		return -ENOMEM;
+	}
+
+	spin_lock(&mem->lock);
+	if (mem->mapped)
+		rc = -EBUSY; /* Writes through mmap() bypass the cache */
+	for (n = 0; rc == 0 && n < mem->num_shadow; n++) {
+		o = &mem->shadow[n];
+		if (offset <= o->offset + mem->stride * (o->count - 1) &&
+		    o->offset <= last) {
+			rc = -EEXIST; /* Overlaps already cached range */
+			break;
+		}
+	}
+	if (rc == 0 && mem->num_shadow == ARRAY_SIZE(mem->shadow))
+		rc = -ENOSPC;
+	if (rc == 0) {
+		mem->shadow[mem->num_shadow] = s;
+		WRITE_ONCE(mem->num_shadow, mem->num_shadow + 1);
+	}
+	spin_unlock(&mem->lock);
+
+	if (rc)
+		free_regb_shadows(&s, 1);
+	return rc;
+}
+
+static int do_modify_regb(struct bifrost_device *bifrost, int bar, u32 offset,
+			  u32 clear, u32 set, u32 *value)
+{
+	struct device_memory *mem;
+	int rc;
+	u32 v;
+
+	rc = check_bar_access(bifrost, bar, (RD_ACCESS | WR_ACCESS), offset);
+	if (rc < 0)
+		return rc;
+
+	mem = &bifrost->regb[bar];
+
+	/*
+	 * Note: these registers are only accessed from user-space and
+	 *	 never from ISRs etc. so a spin_lock/unlock should be
+	 *	 enough...
+	 */
+	spin_lock(&mem->lock);
+	rc = __shadow_rd(mem, offset, &v);
+	if (rc < 0)
+		goto e_exit;
+	v = (v & ~clear) | set;
+	rc = __shadow_wr(mem, offset, v);
+	if (rc < 0)
+		goto e_exit;
+	spin_unlock(&mem->lock);
+	*value = v;
+
+	INFO("BIFROST_IOCTL_MODIFY_REGB%u %#08x=%#08x\n", bar, offset, *value);
+
+	return 0;
+
+e_exit:
+	spin_unlock(&mem->lock);
+	return rc;
+}
+
+static int do_read_regb(struct bifrost_device *bifrost, int bar,
+			unsigned int offset, unsigned int *value)
+{
+	struct device_memory *mem;
+	int v;
+
+	v = check_bar_access(bifrost, bar, RD_ACCESS, offset);
+	if (v < 0)
+		return v;
+
+
+	mem = &bifrost->regb[bar];
+	if (mem->rd_lockless && READ_ONCE(mem->num_shadow) == 0) {
+		/* A single device access, a cache added meanwhile can wait */
+		v = mem->rd(mem->handle, offset, value);
+	} else {
+		spin_lock(&mem->lock);
+		v = __shadow_rd(mem, offset, value);
+		spin_unlock(&mem->lock);
+	}
+
+
+	if (v < 0)
+		return v;
+
+	INFO("BIFROST_IOCTL_READ_REGB%u %#08x=%#08x\n", bar, offset, *value);
+
+	return 0;
+}
+
+#define POLL_SPIN_NS 20000    /* Busy poll time before sleeping */
+#define POLL_SLEEP_MIN_US 10  /* First sleep between polls */
+#define POLL_SLEEP_MAX_US 1000
+
+/**
+ * Wait until (register & mask) == value. The register is polled busily for
+ * POLL_SPIN_NS, then with sleeps doubling from POLL_SLEEP_MIN_US up to
+ * POLL_SLEEP_MAX_US.
+ *
+ * @param bifrost The device handle.
+ * @param p Poll arguments, result and elapsed_ns are updated.
+ * @return 0 on success, -ETIMEDOUT on timeout.
+ */
+static int do_poll_regb(struct bifrost_device *bifrost,
+			struct bifrost_regb_poll *p)
+{
+	struct device_memory *mem;
+	u64 start, now, timeout_ns;
+	unsigned int sleep_us = POLL_SLEEP_MIN_US;
+	int rc;
+
+	rc = check_bar_access(bifrost, p->bar, RD_ACCESS, p->offset);
+	if (rc < 0)
+		return rc;
+
+	mem = &bifrost->regb[p->bar];
+	timeout_ns = (u64)p->timeout_us * NSEC_PER_USEC;
+	start = ktime_get_ns();
+	for (;;) {
+		if (mem->rd_lockless) {
+			rc = mem->rd(mem->handle, p->offset, &p->result);
+		} else {
+			spin_lock(&mem->lock);
+			rc = mem->rd(mem->handle, p->offset, &p->result);
+			spin_unlock(&mem->lock);
+		}
+		now = ktime_get_ns();
+		p->elapsed_ns = now - start;
+		if (rc < 0)
+			return rc;
+		if ((p->result & p->mask) == p->value)
+			return 0;
+		if (p->elapsed_ns >= timeout_ns)
+			return -ETIMEDOUT;
+		if (signal_pending(current))
+			return -EINTR;
+
+		if (p->elapsed_ns < POLL_SPIN_NS) {
+			cpu_relax();
+			continue;
+		}
+		usleep_range(sleep_us, sleep_us + sleep_us / 2);
+		sleep_us = min(2 * sleep_us, (unsigned int)POLL_SLEEP_MAX_US);
+	}
+}
+
+#define RANGE_STACK_REGS 64   /* Registers read without allocation */
+#define RANGE_CHUNK_REGS 1024 /* Registers read per lock and copy */
+
+/**
+ * Read registers 'incr' bytes apart, or the same register repeatedly if
+ * incr is zero, to user space. Access is checked once for the whole window
+ * and the BAR lock is taken once per RANGE_CHUNK_REGS registers.
+ *
+ * @param bifrost The device handle.
+ * @param bar BAR number.
+ * @param offset Offset of first register.
+ * @param incr Distance between registers, 4 or 0.
+ * @param uvalues User space array of count values.
+ * @param count Number of registers to read.
+ * @return 0 on success.
+ */
+static int do_read_range_regb(struct bifrost_device *bifrost, int bar,
+			      u32 offset, u32 incr, u32 __user *uvalues,
+			      u32 count)
+{
+	u32 stack_buf[RANGE_STACK_REGS], *buf = stack_buf;
+	struct device_memory *mem;
+	u32 n, i, chunk;
+	int rc;
+
+	if (count == 0)
+		return 0;
+
+	rc = check_bar_access(bifrost, bar, RD_ACCESS, offset);
+	if (rc < 0)
+		return rc;
+	mem = &bifrost->regb[bar];
+	if ((u64)offset + (u64)incr * (count - 1) >= mem->size)
+		return -EFAULT; /* Range is out-of-range */
+
+	if (count > RANGE_STACK_REGS) {
+		buf = kmalloc_array(min_t(u32, count, RANGE_CHUNK_REGS),
+				    sizeof(u32), GFP_KERNEL);
+		if (buf == NULL)
+			return -ENOMEM;
+	}
+
+	for (n = 0; n < count; n += chunk) {
+		chunk = min_t(u32, count - n, RANGE_CHUNK_REGS);
+		spin_lock(&mem->lock);
+		if (mem->rd_range) {
+			rc = mem->rd_range(mem->handle, offset + n * incr, incr,
+					   buf, chunk);
+		} else {
+			for (i = 0, rc = 0; i < chunk && rc >= 0; i++)
+				rc = mem->rd(mem->handle, offset + (n + i) * incr,
+					     &buf[i]);
+		}
+		spin_unlock(&mem->lock);
+		if (rc < 0)
+			break;
+		if (copy_to_user(&uvalues[n], buf, chunk * sizeof(u32))) {
+			rc = -EFAULT;
+			break;
+		}
+	}
+
+	if (buf != stack_buf)
+		kfree(buf);
+
+	INFO("BIFROST_IOCTL_READ_%s_REGB%u %#08x count %u\n",
+	     incr ? "RANGE" : "REPEAT", bar, offset, count);
+
+	return rc < 0 ? rc : 0;
+}
+
+static int do_write_regb(struct bifrost_device *bifrost, int bar,
+			 unsigned int offset, unsigned int value)
+{
+	struct device_memory *mem;
+	int v;
+
+	v = check_bar_access(bifrost, bar, WR_ACCESS, offset);
+	if (v < 0)
+		return v;
+
+	mem = &bifrost->regb[bar];
+	spin_lock(&mem->lock);
+	v = __shadow_wr(mem, offset, value);
+	spin_unlock(&mem->lock);
+	if (v < 0)
+		return v;
+
+	INFO("BIFROST_IOCTL_WRITE_REGB%u %#08x=%#08x\n", bar, offset, value);
+
+	return 0;
+}
+
+static void bar_vm_open(struct vm_area_struct *vma)
+{
+	struct device_memory *mem = vma->vm_private_data;
+
+	spin_lock(&mem->lock);
+	mem->mapped++;
+	spin_unlock(&mem->lock);
+}
+
+static void bar_vm_close(struct vm_area_struct *vma)
+{
+	struct device_memory *mem = vma->vm_private_data;
+
+	spin_lock(&mem->lock);
+	mem->mapped--;
+	spin_unlock(&mem->lock);
+}
+
+static const struct vm_operations_struct bar_vm_ops = {
+	.open = bar_vm_open,
+	.close = bar_vm_close,
+};
+
+/**
+ * Map a BAR to user space, uncached. A BAR user space only may read, or a
+ * range covering the DMA controller registers, is mapped read-only and
+ * can't be made writable with mprotect(). A BAR with cached register ranges
+ * can't be mapped, see set_regb_cache().
+ *
+ * @param bifrost The device handle.
+ * @param bar BAR number.
+ * @param vma
+ * @return 0 on success.
+ */
+static int mmap_bar(struct bifrost_device *bifrost, int bar,
+		    struct vm_area_struct *vma)
+{
+	unsigned long len = vma->vm_end - vma->vm_start;
+	unsigned long pgoff, pfn;
+	struct device_memory *mem;
+	int rc, access;
+
+	rc = check_bar_access(bifrost, bar, RD_ACCESS, 0);
+	if (rc < 0)
+		return rc;
+	mem = &bifrost->regb[bar];
+	access = bar_access(bifrost, bar);
+
+	pgoff = vma->vm_pgoff - (BIFROST_MMAP_BAR(bar) >> PAGE_SHIFT);
+	if (mem->addr_bus == 0 ||
+	    (pgoff << PAGE_SHIFT) + len > PAGE_ALIGN(mem->size))
+		return -EINVAL;
+	pfn = (mem->addr_bus >> PAGE_SHIFT) + pgoff;
+
+	/* Pages holding the DMA controller registers are mapped read-only */
+	if (is_dma_regs(bifrost, bar, pgoff << PAGE_SHIFT, len))
+		access &= ~WR_ACCESS;
+
+	if (!(access & WR_ACCESS)) {
+		if (vma->vm_flags & VM_WRITE)
+			return -EACCES;
+#if KERNEL_VERSION(6, 3, 0) <= LINUX_VERSION_CODE
+		vm_flags_clear(vma, VM_MAYWRITE);
+#else
+		vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+	}
+
+	spin_lock(&mem->lock);
+	if (mem->num_shadow) {
+		spin_unlock(&mem->lock);
+		return -EBUSY; /* Cached ranges would go stale */
+	}
+	mem->mapped++;
+	spin_unlock(&mem->lock);
+
+	vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+	rc = io_remap_pfn_range(vma, vma->vm_start, pfn, len,
+				vma->vm_page_prot);
+	if (rc < 0) {
+		spin_lock(&mem->lock);
+		mem->mapped--;
+		spin_unlock(&mem->lock);
+		return rc;
+	}
+
+	vma->vm_private_data = mem;
+	vma->vm_ops = &bar_vm_ops;
+
+	INFO("BAR%d mapped %s at offset %#lx, %lu bytes\n", bar,
+	     (access & WR_ACCESS) ? "rw" : "ro", pgoff << PAGE_SHIFT, len);
+	return 0;
+}
+
+/**
+ * Handler for file operation mmap(). Maps the event ring of the user handle
+ * or a BAR depending on offset, see BIFROST_MMAP_EVENT_RING and
+ * BIFROST_MMAP_BAR().
+ *
+ * @param file
+ * @param vma
+ * @return 0 on success.
+ */
+static int bifrost_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct bifrost_user_handle *hnd = file->private_data;
+	unsigned long off = vma->vm_pgoff >> (ilog2(BIFROST_MMAP_BAR_SPAN) -
+					       PAGE_SHIFT);
+
+	if (off == 0)
+		return mmap_event_ring(hnd, vma);
+
+	return mmap_bar(hnd->bifrost, off - 1, vma);
+}
+
+static int regb_op_access(u32 op)
+{
+	switch (op) {
+	case BIFROST_REGB_OP_READ:
+		return RD_ACCESS;
+	case BIFROST_REGB_OP_WRITE:
+		return WR_ACCESS;
+	case BIFROST_REGB_OP_MODIFY:
+		return RD_ACCESS | WR_ACCESS;
+	}
+	return -EINVAL;
+}
+
+/* Requires that the lock of the BAR is held */
+static int __do_regb_op(struct device_memory *mem, struct bifrost_regb_op *o)
+{
+	int rc;
+	u32 v;
+
+	switch (o->op) {
+	case BIFROST_REGB_OP_READ:
+		return __shadow_rd(mem, o->offset, &o->value);
+	case BIFROST_REGB_OP_WRITE:
+		return __shadow_wr(mem, o->offset, o->value);
+	}
+
+	rc = __shadow_rd(mem, o->offset, &v);
+	if (rc < 0)
+		return rc;
+	v = (v & ~o->clear) | o->set;
+	rc = __shadow_wr(mem, o->offset, v);
+	if (rc < 0)
+		return rc;
+	o->value = v;
+	return 0;
+}
+
+/**
+ * Execute a list of register operations. All operations are validated
+ * before any is executed and the BAR lock is taken once per run of
+ * operations on the same BAR, but at most for REGB_OPS_CHUNK operations.
+ *
+ * @param bifrost The device handle.
+ * @param ops The operations, read values are returned in place.
+ * @param count Number of operations.
+ * @param done Returns number of operations done.
+ * @return 0 on success.
+ */
+#define REGB_OPS_CHUNK 64 /* Register operations per lock */
+
+static int do_regb_ops(struct bifrost_device *bifrost,
+		       struct bifrost_regb_op *ops, u32 count, u32 *done)
+{
+	struct device_memory *mem = NULL;
+	int access, rc = 0;
+	u32 n;
+
+	*done = 0;
+	for (n = 0; n < count; n++) {
+		access = regb_op_access(ops[n].op);
+		if (access < 0)
+			return access;
+		rc = check_bar_access(bifrost, ops[n].bar, access,
+				      ops[n].offset);
+		if (rc < 0)
+			return rc;
+	}
+
+	for (n = 0; n < count; n++) {
+		if (mem != &bifrost->regb[ops[n].bar] ||
+		    (n % REGB_OPS_CHUNK) == 0) {
+			if (mem)
+				spin_unlock(&mem->lock);
+			mem = &bifrost->regb[ops[n].bar];
+			spin_lock(&mem->lock);
+		}
+		rc = __do_regb_op(mem, &ops[n]);
+		if (rc < 0)
+			break;
+	}
+	if (mem)
+		spin_unlock(&mem->lock);
+	*done = n;
 
-	INFO("BIFROST_IOCTL_MODIFY_REGB%u %#08x=%#08x\n", bar, offset, *value);
+	return rc;
+}
 
-	return 0;
+/*
+ * Do the queued posted writes of a user handle, the BAR lock is taken once
+ * per run of writes to the same BAR. Writes after a failing one are
+ * dropped. Requires that posted_lock is held.
+ */
+static int __flush_posted_writes(struct bifrost_user_handle *hnd)
+{
+	struct bifrost_device *bifrost = hnd->bifrost;
+	struct device_memory *mem = NULL;
+	struct bifrost_posted_write *w;
+	unsigned int n;
+	int rc = 0;
+
+	for (n = 0; n < hnd->num_posted; n++) {
+		w = &hnd->posted[n];
+		if (mem != &bifrost->regb[w->bar]) {
+			if (mem)
+				spin_unlock(&mem->lock);
+			mem = &bifrost->regb[w->bar];
+			spin_lock(&mem->lock);
+		}
+		rc = __shadow_wr(mem, w->offset, w->value);
+		if (rc < 0)
+			break;
+	}
+	if (mem)
+		spin_unlock(&mem->lock);
+	hnd->num_posted = 0;
 
-e_exit:
-	spin_unlock(&mem->lock);
 	return rc;
 }
 
-static int do_read_regb(struct bifrost_device *bifrost, int bar,
-			unsigned int offset, unsigned int *value)
+static int flush_posted_writes(struct bifrost_user_handle *hnd)
 {
-	struct device_memory *mem;
-	int v;
+	int rc;
 
-	v = check_bar_access(bifrost, bar, RD_ACCESS, offset);
-	if (v < 0)
-		return v;
+	if (READ_ONCE(hnd->posted) == NULL)
+		return 0;
 
+	mutex_lock(&hnd->posted_lock);
+	rc = __flush_posted_writes(hnd);
+	mutex_unlock(&hnd->posted_lock);
 
-	mem = &bifrost->regb[bar];
-	spin_lock(&mem->lock);
-	v = mem->rd(mem->handle, offset, value);
-	spin_unlock(&mem->lock);
+	return rc;
+}
 
+/**
+ * Queue a register write if posted writes are enabled on the user handle.
+ * Access is checked when queueing.
+ *
+ * @param hnd The user handle.
+ * @param bar BAR number.
+ * @param offset Register offset.
+ * @param value Value to write.
+ * @return 0 if queued, 1 if posted writes are disabled or negative errno.
+ */
+static int post_write(struct bifrost_user_handle *hnd, int bar, u32 offset,
+		      u32 value)
+{
+	struct bifrost_posted_write *w;
+	int rc;
 
-	if (v < 0)
-		return v;
+	rc = check_bar_access(hnd->bifrost, bar, WR_ACCESS, offset);
+	if (rc < 0)
+		return rc;
 
-	INFO("BIFROST_IOCTL_READ_REGB%u %#08x=%#08x\n", bar, offset, *value);
+	mutex_lock(&hnd->posted_lock);
+	if (hnd->posted == NULL) {
+		rc = 1;
+		goto out;
+	}
+	if (hnd->num_posted == BIFROST_POSTED_WRITES_MAX) {
+		rc = __flush_posted_writes(hnd);
+		if (rc < 0)
+			goto out;
+	}
+	w = &hnd->posted[hnd->num_posted++];
+	w->bar = bar;
+	w->offset = offset;
+	w->value = value;
+out:
+	mutex_unlock(&hnd->posted_lock);
 
-	return 0;
+	return rc;
 }
 
-static int do_write_regb(struct bifrost_device *bifrost, int bar,
-			 unsigned int offset, unsigned int value)
+static int set_posted_writes(struct bifrost_user_handle *hnd, bool enable)
 {
-	struct device_memory *mem;
-	int v;
-
-	v = check_bar_access(bifrost, bar, WR_ACCESS, offset);
-	if (v < 0)
-		return v;
-
-	mem = &bifrost->regb[bar];
-	spin_lock(&mem->lock);
-	v = mem->wr(mem->handle, offset, value);
-	spin_unlock(&mem->lock);
-	if (v < 0)
-		return v;
+	int rc = 0;
+
+	mutex_lock(&hnd->posted_lock);
+	if (enable && hnd->posted == NULL) {
+		hnd->posted = kmalloc_array(BIFROST_POSTED_WRITES_MAX,
+					    sizeof(*hnd->posted), GFP_KERNEL);
+		if (hnd->posted == NULL)
+			rc = -ENOMEM;
+	} else if (!enable && hnd->posted) {
+		rc = __flush_posted_writes(hnd);
+		kfree(hnd->posted);
+		hnd->posted = NULL;
+	}
+	mutex_unlock(&hnd->posted_lock);
 
-	INFO("BIFROST_IOCTL_WRITE_REGB%u %#08x=%#08x\n", bar, offset, value);
+	return rc;
+}
 
-	return 0;
+/* ioctls that must see the posted writes of the handle done */
+static bool ioctl_needs_fence(unsigned int cmd)
+{
+	switch (cmd) {
+	case BIFROST_IOCTL_READ_REGB:
+	case BIFROST_IOCTL_READ_RANGE_REGB:
+	case BIFROST_IOCTL_READ_REPEAT_REGB:
+	case BIFROST_IOCTL_WRITE_REPEAT_REGB:
+	case BIFROST_IOCTL_MODIFY_REGB:
+	case BIFROST_IOCTL_REGB_OPS:
+	case BIFROST_IOCTL_POLL_REGB:
+	case BIFROST_IOCTL_START_DMA_UP:
+	case BIFROST_IOCTL_START_DMA_DOWN:
+	case BIFROST_IOCTL_START_DMA_UP_USER:
+	case BIFROST_IOCTL_START_DMA_DOWN_USER:
+	case BIFROST_IOCTL_START_DMA_UP_BUFFER:
+	case BIFROST_IOCTL_START_DMA_DOWN_BUFFER:
+	case BIFROST_IOCTL_START_DMA_UP_DMABUF:
+	case BIFROST_IOCTL_START_DMA_DOWN_DMABUF:
+	case BIFROST_IOCTL_WRITE_FENCE:
+		return true;
+	}
+	return false;
 }
 
 int bifrost_do_xfer(struct bifrost_device *bifrost, void __user *uarg, struct bifrost_user_handle *hnd, int flags, int dir)
@@ -668,6 +2916,12 @@ static long bifrost_unlocked_ioctl(struct file *file, unsigned int cmd,
 
 	bifrost->stats.ioctls++;
 
+	if (ioctl_needs_fence(cmd)) {
+		rc = flush_posted_writes(hnd);
+		if (rc < 0)
+			return rc;
+	}
+
 	switch (cmd) {
 	case BIFROST_IOCTL_INFO:
 	{
@@ -694,31 +2948,14 @@ static long bifrost_unlocked_ioctl(struct file *file, unsigned int cmd,
 	case BIFROST_IOCTL_READ_RANGE_REGB:
 	case BIFROST_IOCTL_READ_REPEAT_REGB:
 	{
-		u32 i, *buf;
-		void __user *user_ptr;
 		struct bifrost_access_range a;
-		int incr = (cmd == BIFROST_IOCTL_READ_RANGE_REGB) ? 4 : 0;
+		u32 incr = (cmd == BIFROST_IOCTL_READ_RANGE_REGB) ? 4 : 0;
 
 		if (copy_from_user(&a, uarg, sizeof(a)))
 			return -ENOMEM;
 
-		user_ptr = (void __user *)a.values;
-		buf = kmalloc(sizeof(u32) * a.count, GFP_KERNEL);
-		if (buf == NULL)
-			return -ENOMEM;
-
-		for (i = 0; i < a.count; ++i) {
-			rc = do_read_regb(bifrost, a.bar, a.offset + i * incr, &buf[i]);
-			if (rc < 0) {
-				kfree(buf);
-				return rc;
-			}
-		}
-
-		if (copy_to_user(user_ptr, (void *)buf, sizeof(u32) * a.count))
-			rc = -EFAULT;
-
-		kfree(buf);
+		rc = do_read_range_regb(bifrost, a.bar, a.offset, incr,
+					(u32 __user *)a.values, a.count);
 		break;
 	}
 
@@ -729,7 +2966,9 @@ static long bifrost_unlocked_ioctl(struct file *file, unsigned int cmd,
 		if (copy_from_user(&a, uarg, sizeof(a)))
 			return -ENOMEM;
 
-		rc = do_write_regb(bifrost, a.bar, a.offset, a.value);
+		rc = post_write(hnd, a.bar, a.offset, a.value);
+		if (rc == 1)
+			rc = do_write_regb(bifrost, a.bar, a.offset, a.value);
 		if (rc < 0)
 			return rc;
 		break;
@@ -778,6 +3017,30 @@ static long bifrost_unlocked_ioctl(struct file *file, unsigned int cmd,
 		break;
 	}
 
+	case BIFROST_IOCTL_REGB_OPS:
+	{
+		struct bifrost_regb_ops r;
+		struct bifrost_regb_op *ops;
+		u32 done;
+
+		if (copy_from_user(&r, uarg, sizeof(r)))
+			return -EFAULT;
+		if (r.count == 0 || r.count > BIFROST_REGB_OPS_MAX)
+			return -EINVAL;
+		ops = memdup_user((void __user *)r.ops, r.count * sizeof(*ops));
+		if (IS_ERR(ops))
+			return PTR_ERR(ops);
+
+		rc = do_regb_ops(bifrost, ops, r.count, &done);
+		INFO("BIFROST_IOCTL_REGB_OPS %u/%u (%d)\n", done, r.count, rc);
+		r.count = done;
+		if (copy_to_user((void __user *)r.ops, ops, done * sizeof(*ops)) ||
+		    copy_to_user(uarg, &r, sizeof(r)))
+			rc = -EFAULT;
+		kfree(ops);
+		break;
+	}
+
 	case BIFROST_IOCTL_START_DMA_UP_USER:
 		flags =  BIFROST_DMA_USER_BUFFER;
 		rc = bifrost_do_xfer(bifrost, uarg, hnd, flags, BIFROST_DMA_DIRECTION_UP);
@@ -793,11 +3056,128 @@ static long bifrost_unlocked_ioctl(struct file *file, unsigned int cmd,
 		rc = bifrost_do_xfer(bifrost, uarg, hnd, flags, BIFROST_DMA_DIRECTION_DOWN);
 		break;
 
+	case BIFROST_IOCTL_REGISTER_DMA_BUFFER:
+	{
+		struct bifrost_dma_buffer b;
+
+		if (copy_from_user(&b, uarg, sizeof(b)))
+			return -EFAULT;
+		rc = register_dma_buffer(hnd, b.system, b.size);
+		if (rc < 0)
+			return rc;
+		b.id = rc;
+		if (copy_to_user(uarg, &b, sizeof(b))) {
+			unregister_dma_buffer(hnd, b.id);
+			return -EFAULT;
+		}
+		INFO("BIFROST_IOCTL_REGISTER_DMA_BUFFER %u: %llx, %u bytes\n",
+		     b.id, b.system, b.size);
+		rc = 0;
+		break;
+	}
+
+	case BIFROST_IOCTL_UNREGISTER_DMA_BUFFER:
+	{
+		u32 id;
+
+		if (copy_from_user(&id, uarg, sizeof(id)))
+			return -EFAULT;
+		rc = unregister_dma_buffer(hnd, id);
+		break;
+	}
+
+	case BIFROST_IOCTL_EXPORT_DMA_BUFFER:
+	{
+		struct bifrost_dmabuf_export x;
+		struct dma_buf *dmabuf;
+		u64 bus_addr;
+
+		if (copy_from_user(&x, uarg, sizeof(x)))
+			return -EFAULT;
+		dmabuf = bifrost_dmabuf_export(bifrost, x.size, &bus_addr);
+		if (IS_ERR(dmabuf))
+			return PTR_ERR(dmabuf);
+		x.fd = get_unused_fd_flags(O_CLOEXEC);
+		if (x.fd < 0) {
+			dma_buf_put(dmabuf); /* Frees buffer */
+			return x.fd;
+		}
+		x.size = PAGE_ALIGN(x.size);
+		x.system = bus_addr;
+		/* Install the fd only once user space is told about it */
+		if (copy_to_user(uarg, &x, sizeof(x))) {
+			put_unused_fd(x.fd);
+			dma_buf_put(dmabuf);
+			return -EFAULT;
+		}
+		fd_install(x.fd, dmabuf->file);
+		rc = 0;
+		break;
+	}
+
+	case BIFROST_IOCTL_START_DMA_UP_BUFFER:
+	case BIFROST_IOCTL_START_DMA_DOWN_BUFFER:
+	{
+		struct bifrost_dma_buffer_transfer bx;
+
+		if (copy_from_user(&bx, uarg, sizeof(bx)))
+			return -EFAULT;
+		rc = do_dma_start_buffer(bifrost->dma_ctl, hnd,
+					 get_dma_buffer(hnd, bx.id), &bx,
+					 cmd == BIFROST_IOCTL_START_DMA_UP_BUFFER ?
+					 BIFROST_DMA_DIRECTION_UP :
+					 BIFROST_DMA_DIRECTION_DOWN);
+		break;
+	}
+
+	case BIFROST_IOCTL_IMPORT_DMABUF:
+	{
+		struct bifrost_dmabuf_import im;
+		bool added;
+
+		if (copy_from_user(&im, uarg, sizeof(im)))
+			return -EFAULT;
+		rc = import_dma_buffer(hnd, im.fd, &im.size, &added);
+		if (rc < 0)
+			return rc;
+		im.id = rc;
+		if (copy_to_user(uarg, &im, sizeof(im))) {
+			if (added)
+				unregister_dma_buffer(hnd, im.id);
+			return -EFAULT;
+		}
+		INFO("BIFROST_IOCTL_IMPORT_DMABUF fd %d: id %u, %u bytes\n",
+		     im.fd, im.id, im.size);
+		rc = 0;
+		break;
+	}
+
+	case BIFROST_IOCTL_START_DMA_UP_DMABUF:
+	case BIFROST_IOCTL_START_DMA_DOWN_DMABUF:
+	{
+		struct bifrost_dmabuf_transfer dx;
+		struct bifrost_dma_buffer_transfer bx;
+
+		if (copy_from_user(&dx, uarg, sizeof(dx)))
+			return -EFAULT;
+		bx.offset = dx.offset;
+		bx.device = dx.device;
+		bx.size = dx.size;
+		rc = do_dma_start_buffer(bifrost->dma_ctl, hnd,
+					 get_dma_buffer_fd(hnd, dx.fd), &bx,
+					 cmd == BIFROST_IOCTL_START_DMA_UP_DMABUF ?
+					 BIFROST_DMA_DIRECTION_UP :
+					 BIFROST_DMA_DIRECTION_DOWN);
+		break;
+	}
+
 	case BIFROST_IOCTL_ENABLE_EVENT:
 	{
 		u32 mask = (u32)arg;
 
-		hnd->event_enable_mask = mask;
+		rc = set_event_masks(hnd, mask, hnd->irq_forwarding_mask);
+		if (rc < 0)
+			return rc;
 		INFO("BIFROST_IOCTL_ENABLE_EVENT mask %#08x\n", mask);
 		break;
 	}
@@ -806,29 +3186,188 @@ static long bifrost_unlocked_ioctl(struct file *file, unsigned int cmd,
 	{
 		u32 mask = (u32)arg;
 
-		hnd->irq_forwarding_mask = mask;
+		rc = set_event_masks(hnd, hnd->event_enable_mask, mask);
+		if (rc < 0)
+			return rc;
 		INFO("BIFROST_IOCTL_IRQ_FORWARDING mask %#08x\n", mask);
 		break;
 	}
 
 	case BIFROST_IOCTL_DEQUEUE_EVENT:
 	{
-		struct bifrost_event_cont *p;
-
 		INFO("BIFROST_IOCTL_DEQUEUE_EVENT\n");
-		p = dequeue_event(hnd);
-		if (p == NULL)
+		rc = dequeue_events(hnd, uarg, 1, sizeof(struct bifrost_event));
+		if (rc < 0)
+			return rc;
+		if (rc == 0)
 			return -EINVAL;
-#if KERNEL_VERSION(5, 10, 0) <= LINUX_VERSION_CODE
-		p->event.timestamp.forwarded = ns_to_kernel_old_timeval(ktime_get_real_ns());
-#else
-		do_gettimeofday(&p->event.timestamp.forwarded);
-#endif
-		if (copy_to_user(uarg, &p->event, sizeof(p->event)) != 0) {
-			kfree(p);
+		rc = 0;
+		break;
+	}
+
+	case BIFROST_IOCTL_DEQUEUE_EVENTS:
+	{
+		struct bifrost_event_batch b;
+
+		if (copy_from_user(&b, uarg, sizeof(b)))
+			return -EFAULT;
+		rc = dequeue_events(hnd, (void __user *)b.events, b.count,
+				    READ_ONCE(hnd->entry_size));
+		if (rc < 0)
+			return rc;
+		INFO("BIFROST_IOCTL_DEQUEUE_EVENTS %d/%u\n", rc, b.count);
+		b.count = rc;
+		rc = 0;
+		if (copy_to_user(uarg, &b, sizeof(b)))
 			return -EFAULT;
+		break;
+	}
+
+	case BIFROST_IOCTL_EVENT_RING_INFO:
+	{
+		struct bifrost_event_ring r;
+
+		INFO("BIFROST_IOCTL_EVENT_RING_INFO\n");
+		memset(&r, 0, sizeof(r));
+		spin_lock_irq(&hnd->ring_lock);
+		r.size = hnd->ring_mask + 1;
+		r.entry_size = hnd->entry_size;
+		r.offset = PAGE_SIZE;
+		r.mmap_size = hnd->ring_len;
+		r.dropped = hnd->dropped;
+		r.coalesced = hnd->coalesced;
+		r.head = hnd->ring_head;
+		r.tail = READ_ONCE(hnd->ring->tail);
+		spin_unlock_irq(&hnd->ring_lock);
+		if (copy_to_user(uarg, &r, sizeof(r)) != 0)
+			return -EFAULT;
+		break;
+	}
+
+	case BIFROST_IOCTL_SET_EVENT_QUEUE:
+	case BIFROST_IOCTL_GET_EVENT_QUEUE:
+	{
+		struct bifrost_event_queue q;
+
+		if (cmd == BIFROST_IOCTL_SET_EVENT_QUEUE) {
+			if (copy_from_user(&q, uarg, sizeof(q)))
+				return -EFAULT;
+			rc = set_event_queue(hnd, q.depth, q.policy);
+			if (rc < 0)
+				return rc;
+			INFO("BIFROST_IOCTL_SET_EVENT_QUEUE depth %u policy %u\n",
+			     q.depth, q.policy);
 		}
-		kfree(p);
+		spin_lock_irq(&hnd->ring_lock);
+		q.depth = hnd->ring_mask + 1;
+		q.policy = hnd->overflow_policy;
+		q.dropped = hnd->dropped;
+		q.coalesced = hnd->coalesced;
+		spin_unlock_irq(&hnd->ring_lock);
+		if (copy_to_user(uarg, &q, sizeof(q)))
+			return -EFAULT;
+		break;
+	}
+
+	case BIFROST_IOCTL_IRQ_COALESCE:
+	{
+		struct bifrost_irq_coalesce c;
+
+		if (copy_from_user(&c, uarg, sizeof(c)))
+			return -EFAULT;
+		rc = bifrost_set_irq_coalesce(c.vector, c.count, c.window_us);
+		if (rc < 0)
+			return rc;
+		INFO("BIFROST_IOCTL_IRQ_COALESCE vector %u count %u window %u us\n",
+		     c.vector, c.count, c.window_us);
+		break;
+	}
+
+	case BIFROST_IOCTL_SET_EVENT_VERSION:
+	{
+		u32 version;
+
+		if (copy_from_user(&version, uarg, sizeof(version)))
+			return -EFAULT;
+		rc = set_event_version(hnd, version);
+		if (rc < 0)
+			return rc;
+		INFO("BIFROST_IOCTL_SET_EVENT_VERSION %u\n", version);
+		break;
+	}
+
+	case BIFROST_IOCTL_BIND_EVENTFD:
+	{
+		struct bifrost_eventfd e;
+
+		if (copy_from_user(&e, uarg, sizeof(e)))
+			return -EFAULT;
+		rc = bind_eventfd(hnd, e.fd, e.irq_mask, e.flags);
+		if (rc < 0)
+			return rc;
+		INFO("BIFROST_IOCTL_BIND_EVENTFD %d irq %#x flags %#x\n",
+		     e.fd, e.irq_mask, e.flags);
+		break;
+	}
+
+	case BIFROST_IOCTL_UNBIND_EVENTFD:
+	{
+		s32 fd;
+
+		if (copy_from_user(&fd, uarg, sizeof(fd)))
+			return -EFAULT;
+		rc = unbind_eventfd(hnd, fd);
+		if (rc < 0)
+			return rc;
+		INFO("BIFROST_IOCTL_UNBIND_EVENTFD %d\n", fd);
+		break;
+	}
+
+	case BIFROST_IOCTL_WAIT_DMA:
+	{
+		struct bifrost_dma_wait w;
+
+		if (copy_from_user(&w, uarg, sizeof(w)))
+			return -EFAULT;
+		rc = wait_dma(hnd, w.id, w.timeout_ms, &w.time);
+		if (rc < 0)
+			return rc;
+		INFO("BIFROST_IOCTL_WAIT_DMA %u %lld ns\n", w.id, w.time);
+		if (copy_to_user(uarg, &w, sizeof(w)))
+			return -EFAULT;
+		break;
+	}
+
+	case BIFROST_IOCTL_WAIT_IRQ:
+	{
+		struct bifrost_irq_wait w;
+
+		if (copy_from_user(&w, uarg, sizeof(w)))
+			return -EFAULT;
+		rc = bifrost_wait_irq(w.vector, w.timeout_ms, &w.count, &w.time);
+		if (rc < 0)
+			return rc;
+		if (copy_to_user(uarg, &w, sizeof(w)))
+			return -EFAULT;
+		break;
+	}
+
+	case BIFROST_IOCTL_POLL_REGB:
+	{
+		struct bifrost_regb_poll p;
+		int prc;
+
+		if (copy_from_user(&p, uarg, sizeof(p)))
+			return -EFAULT;
+		prc = do_poll_regb(bifrost, &p);
+		if (prc < 0 && prc != -ETIMEDOUT && prc != -EINTR)
+			return prc;
+		if (copy_to_user(uarg, &p, sizeof(p)))
+			return -EFAULT;
+		INFO("BIFROST_IOCTL_POLL_REGB%u %#08x=%#08x after %llu ns\n",
+		     p.bar, p.offset, p.result, p.elapsed_ns);
+		if (prc < 0)
+			return prc;
 		break;
 	}
 
@@ -851,6 +3390,37 @@ static long bifrost_unlocked_ioctl(struct file *file, unsigned int cmd,
 		break;
 	}
 
+	case BIFROST_IOCTL_SET_REGB_CACHE:
+	{
+		struct bifrost_regb_cache c;
+
+		if (copy_from_user(&c, uarg, sizeof(c)))
+			return -EFAULT;
+		rc = set_regb_cache(bifrost, c.bar, c.offset, c.count);
+		if (rc < 0)
+			return rc;
+		INFO("BIFROST_IOCTL_SET_REGB_CACHE%u %#08x count %u\n",
+		     c.bar, c.offset, c.count);
+		break;
+	}
+
+	case BIFROST_IOCTL_POSTED_WRITES:
+	{
+		u32 enable;
+
+		if (copy_from_user(&enable, uarg, sizeof(enable)))
+			return -EFAULT;
+		rc = set_posted_writes(hnd, enable != 0);
+		if (rc < 0)
+			return rc;
+		INFO("BIFROST_IOCTL_POSTED_WRITES %u\n", enable);
+		break;
+	}
+
+	case BIFROST_IOCTL_WRITE_FENCE:
+		/* Flushed above */
+		break;
+
 	case BIFROST_IOCTL_RESET_DMA:
 	{
 		/* This is a NOP when running on target! */
@@ -880,7 +3450,9 @@ static const struct file_operations bifrost_fops = {
 	.owner = THIS_MODULE,
 	.open = bifrost_open,
 	.release = bifrost_release,
+	.read = bifrost_read,
 	.poll = bifrost_poll,
+	.mmap = bifrost_mmap,
 #if (KERNEL_VERSION(5, 9, 0) <= LINUX_VERSION_CODE) || defined(HAVE_UNLOCKED_IOCTL)
 	.unlocked_ioctl = bifrost_unlocked_ioctl,
 #else
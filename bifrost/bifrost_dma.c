@@ -55,7 +55,7 @@ static s64 get_xfer_time_ns(TIMETYPE *start)
 #endif
 }
 
-static void kick_off_xfer(struct dma_ctl *ctl, int ch, struct dma_req *req)
+static void stamp_req(struct dma_req *req)
 {
 #if KERNEL_VERSION(5, 10, 0) <= LINUX_VERSION_CODE
 	struct timespec64 ts64;
@@ -66,6 +66,11 @@ static void kick_off_xfer(struct dma_ctl *ctl, int ch, struct dma_req *req)
 #else
 	getnstimeofday(&req->ts);
 #endif
+}
+
+static void kick_off_xfer(struct dma_ctl *ctl, int ch, struct dma_req *req)
+{
+	stamp_req(req);
 	ctl->start_xfer(ctl->data, ch, req->src, req->dst, req->len, req->dir);
 }
 
@@ -156,6 +161,9 @@ struct dma_req *alloc_dma_req(unsigned int *ticket, void *cookie, gfp_t flags)
 	if (req == NULL)
 		return NULL;
 
+	kref_init(&req->ref);
+	init_completion(&req->done);
+	INIT_LIST_HEAD(&req->user_node);
 	req->cookie = cookie;
 	req->ticket = get_ticket();
 	*ticket = req->ticket;
@@ -163,9 +171,20 @@ struct dma_req *alloc_dma_req(unsigned int *ticket, void *cookie, gfp_t flags)
 	return req;
 }
 
+void get_dma_req(struct dma_req *req)
+{
+	kref_get(&req->ref);
+}
+
+static void release_dma_req(struct kref *ref)
+{
+	kfree(container_of(ref, struct dma_req, ref));
+}
+
+/* Drop a reference to a request, may be called from atomic context */
 void free_dma_req(struct dma_req *req)
 {
-	kfree(req);
+	kref_put(&req->ref, release_dma_req);
 }
 
 int start_dma_xfer(struct dma_ctl *ctl, struct dma_req *req)
@@ -190,6 +209,36 @@ int start_dma_xfer(struct dma_ctl *ctl, struct dma_req *req)
 	return 0;
 }
 
+/**
+ * Start a transfer made of segments, e.g. the pages of a user buffer. Each
+ * segment is a request of its own and is started on any idle channel. The
+ * parent request is never started, but completes when the last segment is
+ * done, and only then dma_done() returns the cookie of the parent.
+ *
+ * @param ctl The DMA controller.
+ * @param parent Request representing the whole transfer.
+ * @param segs Segment requests, owned by the controller after the call.
+ * @param count Number of segments, at least one.
+ * @return 0 on success.
+ */
+int start_dma_xfer_sg(struct dma_ctl *ctl, struct dma_req *parent,
+		      struct dma_req **segs, unsigned int count)
+{
+	unsigned int n;
+
+	if (count == 0)
+		return -EINVAL;
+
+	stamp_req(parent);
+	atomic_set(&parent->pending, count);
+	for (n = 0; n < count; n++) {
+		segs[n]->parent = parent;
+		start_dma_xfer(ctl, segs[n]);
+	}
+
+	return 0;
+}
+
 void add_stats(struct bifrost_device *bifrost, struct dma_req *req, s64 time)
 {
 	u64 speed, tmp;
@@ -219,12 +268,48 @@ void add_stats(struct bifrost_device *bifrost, struct dma_req *req, s64 time)
 	}
 }
 
+/**
+ * Complete a request and drop the reference of the DMA controller. Used by
+ * the cleanup work of a request, e.g. to complete it once buffers are
+ * unmapped.
+ *
+ * @param req The request, req->time must be set.
+ * @return The cookie of the request.
+ */
+void *complete_dma_req(struct dma_req *req)
+{
+	void *cookie = req->cookie;
+
+	if (req->pwork)
+		complete(req->pwork);
+
+	complete_all(&req->done);
+	free_dma_req(req);
+
+	return cookie;
+}
+
+static void *complete_req(struct dma_req *req, unsigned int *ticket, s64 *time)
+{
+	*ticket = req->ticket;
+	*time = get_xfer_time_ns(&req->ts);
+	req->time = *time;
+
+	if (req->cleanup) {
+		/* The cleanup work completes the request */
+		queue_work(bifrost_dma_wq, req->cleanup);
+		return ERR_PTR(-EINPROGRESS);
+	}
+
+	return complete_dma_req(req);
+}
+
 void *dma_done(struct dma_ctl *ctl, int irq, unsigned int *ticket, s64 *time, struct bifrost_device *bifrost)
 {
 	unsigned long flags;
 	int ch, start_xfer;
 	void *cookie;
-	struct dma_req *req;
+	struct dma_req *req, *parent;
 
 	ch = lookup_chan(ctl, irq);
 	if ((ch < 0) || (ctl == NULL)) {
@@ -238,18 +323,20 @@ void *dma_done(struct dma_ctl *ctl, int irq, unsigned int *ticket, s64 *time, st
 
 	req = ctl->ch[ch].in_progress;
 	ctl->ch[ch].in_progress = NULL;
-	cookie = req->cookie;
-	*ticket = req->ticket;
-	*time = get_xfer_time_ns(&req->ts);
 
 	if (bifrost->stats.enabled)
-		add_stats(bifrost, req, *time);
+		add_stats(bifrost, req, get_xfer_time_ns(&req->ts));
 
-	if (req->pwork)
-		complete(req->pwork);
-
-
-	kfree(req);
+	parent = req->parent;
+	if (parent == NULL) {
+		cookie = complete_req(req, ticket, time);
+	} else {
+		free_dma_req(req);
+		if (atomic_dec_and_test(&parent->pending))
+			cookie = complete_req(parent, ticket, time);
+		else
+			cookie = ERR_PTR(-EINPROGRESS); /* More segments to go */
+	}
 
 	spin_lock_irqsave(&ctl->lock, flags);
 	if (!list_empty(&ctl->list)) {
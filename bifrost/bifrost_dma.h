@@ -7,6 +7,10 @@
 #include <linux/time.h>
 #include <linux/types.h>
 #include <linux/completion.h>
+#include <linux/dma-direction.h>
+#include <linux/scatterlist.h>
+#include <linux/workqueue.h>
+#include <linux/kref.h>
 #include <linux/version.h>
 
 typedef void (*dma_xfer_t)(void *, u32, u32, u32, u32, u32);
@@ -29,6 +33,14 @@ struct dma_req {
 	void *cookie;
 	TIMETYPE ts;
 	struct completion *pwork;
+	struct work_struct *cleanup; /* Queued instead of completing, see
+				      * complete_dma_req() */
+	struct kref ref;
+	struct completion done;	    /* Completed by dma_done() */
+	s64 time;		    /* Transfer time in ns, valid when done */
+	struct list_head user_node; /* Owned by user of request (cookie) */
+	struct dma_req *parent;	    /* Transfer this is a segment of */
+	atomic_t pending;	    /* Segments not done, see start_dma_xfer_sg() */
 };
 
 struct dma_usr_req {
@@ -41,6 +53,45 @@ struct dma_usr_req {
 	void *cookie;
 };
 
+/* User space buffer pinned and mapped for DMA without bounce buffer */
+struct dma_user_sg {
+	struct page **pages;
+	unsigned int num_pages;
+	struct sg_table sgt;
+	int nents;		    /* Number of mapped segments */
+	enum dma_data_direction dir;
+	struct device *dev;
+	struct dma_req *req;	    /* Transfer using the buffer */
+	struct work_struct work;    /* Unmaps buffer when transfer is done */
+};
+
+#define DMA_USER_ALIGN 8 /* Alignment of user buffers mapped for DMA */
+
+/* Mapped segment of a registered buffer */
+struct dma_buffer_seg {
+	u32 offset;		    /* Offset in buffer */
+	u32 len;
+	dma_addr_t addr;
+};
+
+struct dma_buf;
+struct dma_buf_attachment;
+
+/*
+ * User space buffer registered for DMA, see BIFROST_IOCTL_REGISTER_DMA_BUFFER,
+ * or imported dma-buf, see BIFROST_IOCTL_IMPORT_DMABUF
+ */
+struct dma_reg_buffer {
+	struct kref ref;	    /* User handle and transfers in flight */
+	struct dma_user_sg u;	    /* Only dev is used by imports */
+	struct dma_buf *dmabuf;	    /* Set if imported */
+	struct dma_buf_attachment *attach;
+	struct sg_table *sgt;
+	u32 size;
+	unsigned int num_segs;
+	struct dma_buffer_seg segs[];
+};
+
 struct dma_ch;
 struct dma_ctl;
 struct bifrost_device;
@@ -54,9 +105,17 @@ extern void disable_dma_ch(struct dma_ctl *ctl, int ch);
 
 extern struct dma_req *alloc_dma_req(unsigned int *ticket, void *cookie,
 				     gfp_t flags);
+extern void get_dma_req(struct dma_req *req);
 extern void free_dma_req(struct dma_req *req);
 extern int start_dma_xfer(struct dma_ctl *ctl, struct dma_req *req);
+extern int start_dma_xfer_sg(struct dma_ctl *ctl, struct dma_req *parent,
+			     struct dma_req **segs, unsigned int count);
 extern void *dma_done(struct dma_ctl *ctl, int irq, unsigned int *ticket,
 		      s64 *time, struct bifrost_device *bifrost);
+extern void *complete_dma_req(struct dma_req *req);
+
+extern struct dma_reg_buffer *bifrost_dmabuf_import(struct bifrost_device *bifrost,
+						    struct dma_buf *dmabuf);
+extern void bifrost_dmabuf_unimport(struct dma_reg_buffer *buf);
 
 #endif
@@ -0,0 +1,358 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) FLIR Systems AB.
+ *
+ * DMA-BUF parts of driver, sharing DMA buffers with other drivers and
+ * processes, in both directions.
+ *
+ */
+
+#include <linux/dma-buf.h>
+#include <linux/dma-mapping.h>
+#include <linux/err.h>
+#include <linux/errno.h>
+#include <linux/fcntl.h>
+#include <linux/list.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/scatterlist.h>
+#include <linux/slab.h>
+#include <linux/version.h>
+
+#include "bifrost.h"
+
+#if KERNEL_VERSION(5, 10, 0) <= LINUX_VERSION_CODE
+
+#if KERNEL_VERSION(6, 13, 0) <= LINUX_VERSION_CODE
+MODULE_IMPORT_NS("DMA_BUF");
+#elif KERNEL_VERSION(5, 16, 0) <= LINUX_VERSION_CODE
+MODULE_IMPORT_NS(DMA_BUF);
+#endif
+
+/*
+ * Exported buffer, coherent memory of the bifrost device
+ */
+struct bifrost_dmabuf {
+	struct device *dev;
+	size_t size;
+	void *virt;
+	dma_addr_t bus_addr;
+	struct mutex lock;		/* Protects attachments */
+	struct list_head attachments;
+};
+
+/* Attachment of an importing device */
+struct bifrost_dmabuf_attachment {
+	struct list_head node;
+	struct device *dev;
+	struct sg_table sgt;
+	enum dma_data_direction dir;	/* DMA_NONE unless mapped */
+};
+
+static int bifrost_dmabuf_attach(struct dma_buf *dmabuf,
+				 struct dma_buf_attachment *attach)
+{
+	struct bifrost_dmabuf *buf = dmabuf->priv;
+	struct bifrost_dmabuf_attachment *a;
+	int rc;
+
+	a = kzalloc(sizeof(*a), GFP_KERNEL);
+	if (a == NULL)
+		return -ENOMEM;
+
+	rc = dma_get_sgtable(buf->dev, &a->sgt, buf->virt, buf->bus_addr,
+			     buf->size);
+	if (rc < 0) {
+		kfree(a);
+		return rc;
+	}
+	a->dev = attach->dev;
+	a->dir = DMA_NONE;
+	attach->priv = a;
+
+	mutex_lock(&buf->lock);
+	list_add(&a->node, &buf->attachments);
+	mutex_unlock(&buf->lock);
+
+	return 0;
+}
+
+static void bifrost_dmabuf_detach(struct dma_buf *dmabuf,
+				  struct dma_buf_attachment *attach)
+{
+	struct bifrost_dmabuf *buf = dmabuf->priv;
+	struct bifrost_dmabuf_attachment *a = attach->priv;
+
+	mutex_lock(&buf->lock);
+	list_del(&a->node);
+	mutex_unlock(&buf->lock);
+
+	sg_free_table(&a->sgt);
+	kfree(a);
+}
+
+static struct sg_table *bifrost_dmabuf_map(struct dma_buf_attachment *attach,
+					   enum dma_data_direction dir)
+{
+	struct bifrost_dmabuf *buf = attach->dmabuf->priv;
+	struct bifrost_dmabuf_attachment *a = attach->priv;
+	int rc;
+
+	rc = dma_map_sgtable(a->dev, &a->sgt, dir, 0);
+	if (rc)
+		return ERR_PTR(rc);
+
+	mutex_lock(&buf->lock);
+	a->dir = dir;
+	mutex_unlock(&buf->lock);
+
+	return &a->sgt;
+}
+
+static void bifrost_dmabuf_unmap(struct dma_buf_attachment *attach,
+				 struct sg_table *sgt,
+				 enum dma_data_direction dir)
+{
+	struct bifrost_dmabuf *buf = attach->dmabuf->priv;
+	struct bifrost_dmabuf_attachment *a = attach->priv;
+
+	mutex_lock(&buf->lock);
+	a->dir = DMA_NONE;
+	mutex_unlock(&buf->lock);
+
+	dma_unmap_sgtable(a->dev, sgt, dir, 0);
+}
+
+static void free_dmabuf(struct bifrost_dmabuf *buf)
+{
+	dma_free_coherent(buf->dev, buf->size, buf->virt, buf->bus_addr);
+	put_device(buf->dev);
+	kfree(buf);
+}
+
+static void bifrost_dmabuf_release(struct dma_buf *dmabuf)
+{
+	free_dmabuf(dmabuf->priv);
+}
+
+static int bifrost_dmabuf_mmap(struct dma_buf *dmabuf,
+			       struct vm_area_struct *vma)
+{
+	struct bifrost_dmabuf *buf = dmabuf->priv;
+
+	return dma_mmap_coherent(buf->dev, vma, buf->virt, buf->bus_addr,
+				 buf->size);
+}
+
+/*
+ * The memory is coherent to bifrost, but importers may access it through
+ * mappings of their own that need syncing.
+ */
+static int bifrost_dmabuf_begin_cpu_access(struct dma_buf *dmabuf,
+					   enum dma_data_direction dir)
+{
+	struct bifrost_dmabuf *buf = dmabuf->priv;
+	struct bifrost_dmabuf_attachment *a;
+
+	mutex_lock(&buf->lock);
+	list_for_each_entry(a, &buf->attachments, node) {
+		if (a->dir != DMA_NONE)
+			dma_sync_sgtable_for_cpu(a->dev, &a->sgt, a->dir);
+	}
+	mutex_unlock(&buf->lock);
+
+	return 0;
+}
+
+static int bifrost_dmabuf_end_cpu_access(struct dma_buf *dmabuf,
+					 enum dma_data_direction dir)
+{
+	struct bifrost_dmabuf *buf = dmabuf->priv;
+	struct bifrost_dmabuf_attachment *a;
+
+	mutex_lock(&buf->lock);
+	list_for_each_entry(a, &buf->attachments, node) {
+		if (a->dir != DMA_NONE)
+			dma_sync_sgtable_for_device(a->dev, &a->sgt, a->dir);
+	}
+	mutex_unlock(&buf->lock);
+
+	return 0;
+}
+
+static const struct dma_buf_ops bifrost_dmabuf_ops = {
+	.attach = bifrost_dmabuf_attach,
+	.detach = bifrost_dmabuf_detach,
+	.map_dma_buf = bifrost_dmabuf_map,
+	.unmap_dma_buf = bifrost_dmabuf_unmap,
+	.release = bifrost_dmabuf_release,
+	.mmap = bifrost_dmabuf_mmap,
+	.begin_cpu_access = bifrost_dmabuf_begin_cpu_access,
+	.end_cpu_access = bifrost_dmabuf_end_cpu_access,
+};
+
+/**
+ * Allocate a DMA buffer and export it as a dma-buf. The caller installs a
+ * file descriptor for it, or drops it with dma_buf_put().
+ *
+ * @param bifrost The device handle.
+ * @param size Size of buffer, rounded up to whole pages.
+ * @param bus_addr Returns bus address of buffer, for DMA transfers.
+ * @return The dma-buf or ERR_PTR() on failure.
+ */
+struct dma_buf *bifrost_dmabuf_export(struct bifrost_device *bifrost,
+				      size_t size, u64 *bus_addr)
+{
+	DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+	struct bifrost_dmabuf *buf;
+	struct dma_buf *dmabuf;
+
+	if (bifrost->pdev == NULL)
+		return ERR_PTR(-EOPNOTSUPP);
+	/* The page aligned size must not wrap, it is returned as a u32 */
+	if (size == 0 || size > U32_MAX - (PAGE_SIZE - 1))
+		return ERR_PTR(-EINVAL);
+
+	buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+	if (buf == NULL)
+		return ERR_PTR(-ENOMEM);
+
+	buf->dev = get_device(&bifrost->pdev->dev);
+	buf->size = PAGE_ALIGN(size);
+	mutex_init(&buf->lock);
+	INIT_LIST_HEAD(&buf->attachments);
+	buf->virt = dma_alloc_coherent(buf->dev, buf->size, &buf->bus_addr,
+				       GFP_KERNEL);
+	if (buf->virt == NULL) {
+		put_device(buf->dev);
+		kfree(buf);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	exp_info.ops = &bifrost_dmabuf_ops;
+	exp_info.size = buf->size;
+	exp_info.flags = O_RDWR;
+	exp_info.priv = buf;
+	dmabuf = dma_buf_export(&exp_info);
+	if (IS_ERR(dmabuf)) {
+		free_dmabuf(buf);
+		return dmabuf;
+	}
+	*bus_addr = buf->bus_addr;
+
+	INFO("Exported %zu bytes at %llx\n", buf->size, (u64)buf->bus_addr);
+
+	return dmabuf;
+}
+
+/**
+ * Attach and map a dma-buf exported by another driver, for bifrost DMA in
+ * both directions. The buffer holds a reference of its own to the dma-buf.
+ *
+ * @param bifrost The device handle.
+ * @param dmabuf The dma-buf.
+ * @return Buffer with one segment per mapped sg entry, or ERR_PTR.
+ */
+struct dma_reg_buffer *bifrost_dmabuf_import(struct bifrost_device *bifrost,
+					     struct dma_buf *dmabuf)
+{
+	struct device *dev = &bifrost->pdev->dev;
+	struct dma_buf_attachment *attach;
+	struct dma_reg_buffer *buf;
+	struct scatterlist *sg;
+	struct sg_table *sgt;
+	u32 offset = 0;
+	int n, rc;
+
+	get_dma_buf(dmabuf);
+	attach = dma_buf_attach(dmabuf, dev);
+	if (IS_ERR(attach)) {
+		rc = PTR_ERR(attach);
+		goto err_attach;
+	}
+#if KERNEL_VERSION(6, 2, 0) <= LINUX_VERSION_CODE
+	sgt = dma_buf_map_attachment_unlocked(attach, DMA_BIDIRECTIONAL);
+#else
+	sgt = dma_buf_map_attachment(attach, DMA_BIDIRECTIONAL);
+#endif
+	if (IS_ERR(sgt)) {
+		rc = PTR_ERR(sgt);
+		goto err_map;
+	}
+
+	buf = kzalloc(struct_size(buf, segs, sgt->nents), GFP_KERNEL);
+	if (buf == NULL) {
+		rc = -ENOMEM;
+		goto err_alloc;
+	}
+	kref_init(&buf->ref);
+	buf->u.dev = dev;
+	buf->dmabuf = dmabuf;
+	buf->attach = attach;
+	buf->sgt = sgt;
+	buf->num_segs = sgt->nents;
+	for_each_sgtable_dma_sg(sgt, sg, n) {
+		/* Segments go straight to the DMA engine, see map_user_buffer */
+		if (sg_dma_address(sg) % DMA_USER_ALIGN ||
+		    sg_dma_len(sg) % DMA_USER_ALIGN) {
+			rc = -EINVAL;
+			goto err_align;
+		}
+		buf->segs[n].offset = offset;
+		buf->segs[n].len = sg_dma_len(sg);
+		buf->segs[n].addr = sg_dma_address(sg);
+		offset += sg_dma_len(sg);
+	}
+	buf->size = offset;
+
+	INFO("Imported %u bytes in %u segments\n", buf->size, buf->num_segs);
+
+	return buf;
+
+err_align:
+	kfree(buf);
+err_alloc:
+#if KERNEL_VERSION(6, 2, 0) <= LINUX_VERSION_CODE
+	dma_buf_unmap_attachment_unlocked(attach, sgt, DMA_BIDIRECTIONAL);
+#else
+	dma_buf_unmap_attachment(attach, sgt, DMA_BIDIRECTIONAL);
+#endif
+err_map:
+	dma_buf_detach(dmabuf, attach);
+err_attach:
+	dma_buf_put(dmabuf);
+	return ERR_PTR(rc);
+}
+
+/* Undo bifrost_dmabuf_import(), the buffer itself is freed by the caller */
+void bifrost_dmabuf_unimport(struct dma_reg_buffer *buf)
+{
+#if KERNEL_VERSION(6, 2, 0) <= LINUX_VERSION_CODE
+	dma_buf_unmap_attachment_unlocked(buf->attach, buf->sgt,
+					  DMA_BIDIRECTIONAL);
+#else
+	dma_buf_unmap_attachment(buf->attach, buf->sgt, DMA_BIDIRECTIONAL);
+#endif
+	dma_buf_detach(buf->dmabuf, buf->attach);
+	dma_buf_put(buf->dmabuf);
+}
+
+#else
+
+struct dma_buf *bifrost_dmabuf_export(struct bifrost_device *bifrost,
+				      size_t size, u64 *bus_addr)
+{
+	return ERR_PTR(-EOPNOTSUPP);
+}
+
+struct dma_reg_buffer *bifrost_dmabuf_import(struct bifrost_device *bifrost,
+					     struct dma_buf *dmabuf)
+{
+	return ERR_PTR(-EOPNOTSUPP);
+}
+
+void bifrost_dmabuf_unimport(struct dma_reg_buffer *buf)
+{
+}
+
+#endif
@@ -32,6 +32,9 @@
 
 struct bifrost_device *bdev;
 
+/* Finishes DMA transfers to user space buffers, outlives the DMA IRQs */
+struct workqueue_struct *bifrost_dma_wq;
+
 /*
  * Module parameters
  */
@@ -40,57 +43,6 @@ static u32 membus;
 module_param(membus, uint, 0400);
 MODULE_PARM_DESC(membus, "Enable memory bus interface to FPGA (instead of PCI)");
 
-#include <linux/mempool.h>
-#include <linux/slab.h>
-#include <linux/workqueue.h>
-
-struct bifrost_work {
-	struct work_struct work;
-	struct bifrost_device *bifrost;
-	struct bifrost_event event;
-};
-
-static mempool_t *work_pool;
-static struct workqueue_struct *work_queue;
-
-static void *mempool_alloc_work(gfp_t flags, void *pool_data)
-{
-	(void)pool_data;
-	return kmalloc(sizeof(struct bifrost_work), flags);
-}
-
-static void mempool_free_work(void *work, void *pool_data)
-{
-	(void)pool_data;
-	kfree(work);
-}
-
-static void work_create_event(struct work_struct *work)
-{
-	struct bifrost_work *w;
-
-	w = container_of(work, struct bifrost_work, work);
-	bifrost_create_event(w->bifrost, &w->event);
-	mempool_free(w, work_pool);
-}
-
-void bifrost_create_event_in_atomic(struct bifrost_device *bifrost,
-				    struct bifrost_event *event)
-{
-	struct bifrost_work *w;
-
-	w = mempool_alloc(work_pool, GFP_ATOMIC);
-	if (w == NULL) {
-		ALERT("dropped event type=%d", event->type);
-		return;
-	}
-
-	INIT_WORK(&w->work, work_create_event);
-	w->bifrost = bifrost;
-	memcpy(&w->event, event, sizeof(*event));
-	queue_work(work_queue, &w->work);
-}
-
 /*
  * Entry point to driver.
  */
@@ -114,21 +66,19 @@ static int __init bifrost_init(void)
 	INFO("FPGA interface %s\n",
 	     bdev->membus == 0 ? "PCIe" : "memory bus");
 
-	INIT_LIST_HEAD(&bdev->list);
-	spin_lock_init(&bdev->lock_list);
+	bdev->platform = bifrost_platform_probe(bdev->membus);
+	INFO("%s platform\n", bdev->platform->name);
 
-	work_pool = mempool_create(20, mempool_alloc_work, mempool_free_work, NULL);
-	if (work_pool == NULL) {
-		ret = -ENOMEM;
-		goto err_alloc_pool;
-	}
+	INIT_LIST_HEAD(&bdev->list);
+	mutex_init(&bdev->lock_list);
 
-	work_queue = create_singlethread_workqueue("bifrost");
-	if (work_queue == NULL) {
+	bifrost_dma_wq = alloc_workqueue("bifrost_dma", WQ_UNBOUND, 0);
+	if (bifrost_dma_wq == NULL) {
 		ret = -ENOMEM;
-		goto err_alloc_queue;
+		goto err_wq;
 	}
 
+	ret = -ENODEV;
 	if (bdev->membus) {
 		/* register as real Membus driver */
 		if (bifrost_membus_init(bdev) != 0) {
@@ -146,11 +96,8 @@ static int __init bifrost_init(void)
 	return 0;
 
 err_pci:
-	flush_workqueue(work_queue);
-	destroy_workqueue(work_queue);
-err_alloc_queue:
-	mempool_destroy(work_pool);
-err_alloc_pool:
+	destroy_workqueue(bifrost_dma_wq);
+err_wq:
 	kfree(bdev);
 
 	ALERT("init failed\n");
@@ -170,9 +117,8 @@ static void __exit bifrost_exit(void)
 	else
 		bifrost_pci_exit(bdev);
 
-	flush_workqueue(work_queue);
-	destroy_workqueue(work_queue);
-	mempool_destroy(work_pool);
+	/* DMA IRQs are gone, no more cleanup work can be queued */
+	destroy_workqueue(bifrost_dma_wq);
 	kfree(bdev);
 }
 
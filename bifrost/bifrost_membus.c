@@ -19,6 +19,9 @@
 #include <linux/version.h>
 #include <linux/stat.h>
 #include <linux/platform_device.h>
+#include <linux/moduleparam.h>
+#include <linux/sched.h>
+#include <linux/cpumask.h>
 
 #include <asm/byteorder.h>
 #include <asm/atomic.h>
@@ -48,6 +51,41 @@ static irqreturn_t FVDIRQ2Service(int irq, void *dev_id);
 #define FPGA_IRQ_1	((3-1)*32 + 17) // GPIO3.17
 #define FPGA_IRQ_2	((3-1)*32 + 18) // GPIO3.18
 
+/*
+ * HostIntr_n(1) and HostIntr_n(2) are threaded, the hard IRQ handler only
+ * timestamps and the slow 16-bit register reads are done in the IRQ thread.
+ * The lines are oneshot, i.e. masked until the thread is done, so the stamp
+ * of an event is never overwritten by the next interrupt. The threads are
+ * SCHED_FIFO, set their priority from user space with chrt on the
+ * irq/<n>-FPGA_IRQ_* threads if needed.
+ */
+static int irq_thread_cpu = -1;
+module_param(irq_thread_cpu, int, 0400);
+MODULE_PARM_DESC(irq_thread_cpu, "CPU to run FPGA IRQ1/IRQ2 and their threads on, -1 = any");
+
+struct fvd_irq_line {
+	struct bifrost_device *bifrost;
+	int irq;
+	spinlock_t lock;	/* 64-bit stamps can tear on 32-bit CPUs */
+	ktime_t stamp;		/* Taken by hard IRQ handler */
+	u64 irq_ns;		/* Same, CLOCK_MONOTONIC */
+};
+
+static struct fvd_irq_line fvd_irq_line[3];
+
+static int request_fvd_irq_thread(struct device *dev, int n, int gpio,
+				  irq_handler_t thread_fn, const char *name);
+
+/* Set affinity of an FPGA IRQ and its thread, NULL removes the hint */
+static int set_fvd_irq_affinity(int irq, const struct cpumask *m)
+{
+#if KERNEL_VERSION(5, 17, 0) <= LINUX_VERSION_CODE
+	return irq_update_affinity_hint(irq, m);
+#else
+	return irq_set_affinity_hint(irq, m);
+#endif
+}
+
 
 // NOTE! - This function must perform 8-bytes (4 16 bit words) bursts to FPGA (bug in iMX6)
 static void fpgaread(u32 dst_addr, void __iomem *src, u32 len)
@@ -85,6 +123,18 @@ int membus_read_device_memory(void *handle, u32 offset, u32 *value)
 	return 0;
 }
 
+int membus_read_range_device_memory(void *handle, u32 offset, u32 incr,
+				    u32 *values, u32 count)
+{
+	struct device_memory *mem = handle;
+	void __iomem *addr = mem->addr + (offset << 1);
+	u32 n;
+
+	for (n = 0; n < count; n++, addr += incr << 1)
+		values[n] = le16_to_cpu(ioread16(addr));
+	return 0;
+}
+
 static int set_mode_device_memory(void *handle, u32 offset, u32 mode)
 {
 	return 0; /* A no-op on HW */
@@ -102,6 +152,9 @@ static void init_device_memory(int n, struct device_memory *mem)
 	mem->rd = membus_read_device_memory;
 	mem->wr = membus_write_device_memory;
 	mem->mset = set_mode_device_memory;
+	mem->rd_range = membus_read_range_device_memory;
+	mem->stride = 1;
+	mem->rd_lockless = true;
 	spin_lock_init(&mem->lock);
 	mutex_init(&mem->iolock);
 }
@@ -187,9 +240,17 @@ int __init bifrost_membus_init(struct bifrost_device *bifrost)
 	if (bifrost_fvd_init(bifrost) != 0)
 		goto err_ioregions;
 
+	rc = sysfs_create_group(&bifrost->dev->kobj, &bifrost_shadow_group);
+	if (rc) {
+		ALERT("failed to add sys fs entry\n");
+		goto err_sysfs;
+	}
+
 	return 0;
 
 	/* stack-like cleanup on error */
+err_sysfs:
+	bifrost_fvd_exit(bifrost);
 err_ioregions:
 	remove_io_regions(bdev);
 	return -ENODEV;
@@ -239,8 +300,8 @@ int  bifrost_fvd_init(struct bifrost_device *bifrost)
 	rc = devm_gpio_request(dev, FPGA_IRQ_1, "FpgaIrq1");
 	rc = gpio_direction_input(FPGA_IRQ_1);
 
-	rc = devm_request_irq(dev, gpio_to_irq(FPGA_IRQ_1), FVDIRQ1Service,
-			 IRQF_TRIGGER_FALLING, "FpgaIrq1", bdev);
+	rc = request_fvd_irq_thread(dev, 1, FPGA_IRQ_1, FVDIRQ1Service,
+				    "FpgaIrq1");
 
 	if (rc) {
 		ALERT("Failed to request FPGA IRQ1 (%d)\n", rc);
@@ -257,8 +318,8 @@ int  bifrost_fvd_init(struct bifrost_device *bifrost)
 	devm_gpio_request(dev, FPGA_IRQ_2, "FpgaIrq2");
 	gpio_direction_input(FPGA_IRQ_2);
 
-	rc = devm_request_irq(dev, gpio_to_irq(FPGA_IRQ_2), FVDIRQ2Service,
-			 IRQF_TRIGGER_FALLING, "FpgaIrq2", bdev);
+	rc = request_fvd_irq_thread(dev, 2, FPGA_IRQ_2, FVDIRQ2Service,
+				    "FpgaIrq2");
 
 	if (rc) {
 		ALERT("Failed to request FPGA IRQ2 (%d)\n", rc);
@@ -277,7 +338,14 @@ err_platform_alloc:
 
 void bifrost_fvd_exit(struct bifrost_device *bifrost)
 {
+	int n;
+
 	INFO("\n");
+	/* Affinity hints must be gone before devm frees the IRQs */
+	for (n = 0; n < ARRAY_SIZE(fvd_irq_line); n++) {
+		if (fvd_irq_line[n].bifrost && irq_thread_cpu >= 0)
+			set_fvd_irq_affinity(fvd_irq_line[n].irq, NULL);
+	}
 	platform_device_unregister(bifrost->pMemDev);
 }
 
@@ -285,6 +353,7 @@ void bifrost_membus_exit(struct bifrost_device *bifrost)
 {
 	INFO("\n");
 
+	sysfs_remove_group(&bifrost->dev->kobj, &bifrost_shadow_group);
 	remove_io_regions(bifrost);
 	bifrost_fvd_exit(bifrost);
 }
@@ -362,6 +431,69 @@ int do_membus_xfer(struct bifrost_device *bifrost,
 	return 0;
 }
 
+/*
+ * Hard IRQ handler of the threaded FPGA interrupts
+ */
+static irqreturn_t FVDIRQStamp(int irq, void *dev_id)
+{
+	struct fvd_irq_line *line = dev_id;
+
+	spin_lock(&line->lock);
+	line->irq_ns = ktime_get_ns();
+	line->stamp = ktime_get_real();
+	spin_unlock(&line->lock);
+	return IRQ_WAKE_THREAD;
+}
+
+/* Get the stamps of the interrupt the IRQ thread is serving */
+static void fvd_irq_stamp(struct fvd_irq_line *line, ktime_t *stamp,
+			  u64 *irq_ns)
+{
+	spin_lock_irq(&line->lock);
+	*stamp = line->stamp;
+	*irq_ns = line->irq_ns;
+	spin_unlock_irq(&line->lock);
+}
+
+static void fvd_frame_time(struct bifrost_event *event, ktime_t stamp)
+{
+#if KERNEL_VERSION(5, 10, 0) <= LINUX_VERSION_CODE
+	struct timespec64 ts64 = ktime_to_timespec64(stamp);
+
+	event->data.frame.time.tv_sec = (__kernel_old_time_t) ts64.tv_sec;
+	event->data.frame.time.tv_nsec = (long) ts64.tv_nsec;
+#else
+	event->data.frame.time = ktime_to_timespec(stamp);
+#endif
+}
+
+static int request_fvd_irq_thread(struct device *dev, int n, int gpio,
+				  irq_handler_t thread_fn, const char *name)
+{
+	struct fvd_irq_line *line = &fvd_irq_line[n];
+	int rc;
+
+	line->bifrost = bdev;
+	line->irq = gpio_to_irq(gpio);
+	spin_lock_init(&line->lock);
+
+	rc = devm_request_threaded_irq(dev, line->irq, FVDIRQStamp, thread_fn,
+				       IRQF_TRIGGER_FALLING | IRQF_ONESHOT,
+				       name, line);
+	if (rc)
+		return rc;
+
+	/* The IRQ thread follows the affinity of its interrupt */
+	if (irq_thread_cpu >= 0) {
+		if (irq_thread_cpu >= nr_cpu_ids || !cpu_online(irq_thread_cpu) ||
+		    set_fvd_irq_affinity(line->irq, cpumask_of(irq_thread_cpu)))
+			ALERT("Failed to set %s affinity to CPU%d\n", name,
+			      irq_thread_cpu);
+	}
+
+	return 0;
+}
+
 /*
  * This is the interrupt service thread
  */
@@ -381,7 +513,7 @@ irqreturn_t FVDInterruptService(int irq, void *dev_id)
 	event.type = BIFROST_EVENT_TYPE_IRQ;
 	event.data.irq_source = 1;
 	event.data.irqstatus.value = exec_status;
-	bifrost_create_event_in_atomic(bifrost, &event);
+	bifrost_create_event(bifrost, &event);
 
 	return IRQ_HANDLED;
 }
@@ -391,10 +523,14 @@ irqreturn_t FVDInterruptService(int irq, void *dev_id)
  */
 static irqreturn_t FVDIRQ1Service(int irq, void *dev_id)
 {
-	struct bifrost_device *bifrost = (struct bifrost_device *)dev_id;
+	struct fvd_irq_line *line = dev_id;
+	struct bifrost_device *bifrost = line->bifrost;
+	ktime_t stamp;
+	u64 irq_ns;
 	struct bifrost_event event;
 	u32 vector, mask;
 
+	fvd_irq_stamp(line, &stamp, &irq_ns);
 	memset(&event, 0, sizeof(event));
 
 	INFO("Irq1 %d\n", irq);
@@ -411,13 +547,13 @@ static irqreturn_t FVDIRQ1Service(int irq, void *dev_id)
 		// Indicate completion
 		event.type = BIFROST_EVENT_TYPE_IRQ;
 		event.data.irq_source = 0x40;
-		bifrost_create_event_in_atomic(bifrost, &event);
+		bifrost_create_event_at(bifrost, &event, irq_ns);
 	}
 	if (mask & vector & 0x20) {	  // HSI (BOB) irq
 		// Indicate completion
 		event.type = BIFROST_EVENT_TYPE_IRQ;
 		event.data.irq_source = 0x02;
-		bifrost_create_event_in_atomic(bifrost, &event);
+		bifrost_create_event_at(bifrost, &event, irq_ns);
 	}
 	if (mask & vector & 0x100) {  // JPEGLS irq
 		u32 frameNo, frameSize;
@@ -436,21 +572,11 @@ static irqreturn_t FVDIRQ1Service(int irq, void *dev_id)
 		membus_read_device_memory(bifrost->regb[0].handle, frameSizeReg, &frameSize);    // JLSBufferSize
 		event.data.frame.frameNo = frameNo;
 		event.data.frame.frameSize = frameSize;
-#if KERNEL_VERSION(5, 10, 0) <= LINUX_VERSION_CODE
-		{
-			struct timespec64 ts64;
-
-			ktime_get_real_ts64(&ts64);
-			event.data.frame.time.tv_sec = (__kernel_old_time_t) ts64.tv_sec;
-			event.data.frame.time.tv_nsec = (long) ts64.tv_nsec;
-		}
-#else
-		getnstimeofday(&event.data.frame.time);
-#endif
+		fvd_frame_time(&event, stamp);
 
 		// printk("lastbuf:%d, size:%d\n", frameNo, frameSize);
 
-		bifrost_create_event_in_atomic(bifrost, &event);
+		bifrost_create_event_at(bifrost, &event, irq_ns);
 	}
 	if (mask & vector & 0x200) {  // DIO irq
 		u32 status = 0;
@@ -475,7 +601,7 @@ static irqreturn_t FVDIRQ1Service(int irq, void *dev_id)
 
 		event.data.irqstatus.value = status;
 
-		bifrost_create_event_in_atomic(bifrost, &event);
+		bifrost_create_event_at(bifrost, &event, irq_ns);
 	}
 	if (mask & vector & 0x400) {  // HSI cable irq
 		u32 hsi_state;
@@ -494,7 +620,7 @@ static irqreturn_t FVDIRQ1Service(int irq, void *dev_id)
 
 		event.data.irqstatus.value = cable_state;
 
-		bifrost_create_event_in_atomic(bifrost, &event);
+		bifrost_create_event_at(bifrost, &event, irq_ns);
 	}
 
 	return IRQ_HANDLED;
@@ -505,11 +631,15 @@ static irqreturn_t FVDIRQ1Service(int irq, void *dev_id)
  */
 static irqreturn_t FVDIRQ2Service(int irq, void *dev_id)
 {
-	struct bifrost_device *bifrost = (struct bifrost_device *)dev_id;
+	struct fvd_irq_line *line = dev_id;
+	struct bifrost_device *bifrost = line->bifrost;
+	ktime_t stamp;
+	u64 irq_ns;
 	struct bifrost_event event;
 	u32 camtype;
 	u32 bufNo, frameCnt, hd1, hd2, hd3, hd4, hd5;
 
+	fvd_irq_stamp(line, &stamp, &irq_ns);
 	memset(&event, 0, sizeof(event));
 
 	// Read camera type
@@ -556,18 +686,8 @@ static irqreturn_t FVDIRQ2Service(int irq, void *dev_id)
 	// Indicate completion
 	event.type = BIFROST_EVENT_TYPE_IRQ;
 	event.data.irq_source = 0x20;
-#if  KERNEL_VERSION(5, 10, 0) <= LINUX_VERSION_CODE
-	{
-		struct timespec64 ts64;
-
-		ktime_get_real_ts64(&ts64);
-		event.data.frame.time.tv_sec = (__kernel_old_time_t) ts64.tv_sec;
-		event.data.frame.time.tv_nsec = (long) ts64.tv_nsec;
-	}
-#else
-	getnstimeofday(&event.data.frame.time);
-#endif
-	bifrost_create_event_in_atomic(bifrost, &event);
+	fvd_frame_time(&event, stamp);
+	bifrost_create_event_at(bifrost, &event, irq_ns);
 
 	return IRQ_HANDLED;
 }
@@ -12,6 +12,7 @@
 #include <linux/delay.h>
 #include <linux/err.h>
 #include <linux/errno.h>
+#include <linux/hrtimer.h>
 #include <linux/init.h>
 #include <linux/interrupt.h>
 #include <linux/kernel.h>
@@ -19,6 +20,7 @@
 #include <linux/version.h>
 #include <linux/stat.h>
 #include <linux/pci.h>
+#include <linux/wait.h>
 
 #include <asm/byteorder.h>
 #include <asm/atomic.h>
@@ -67,7 +69,11 @@ void bifrost_dma_chan_start(void *data, u32 ch, u32 src, u32 dst, u32 len,
 	struct device_memory *mem = bifrost->regb_dma;
 	unsigned long flags;
 
-	spin_lock_irqsave(&mem->lock, flags);
+	/*
+	 * Not mem->lock, user space can't write the DMA controller registers,
+	 * see check_bar_access() and mmap_bar().
+	 */
+	spin_lock_irqsave(&bifrost->dma_chan_lock, flags);
 
 	mem->wr(mem->handle, VALHALLA_ADDR_DMA_CHAN, ch);
 	smp_wmb();
@@ -78,7 +84,7 @@ void bifrost_dma_chan_start(void *data, u32 ch, u32 src, u32 dst, u32 len,
 	smp_wmb();
 	mem->wr(mem->handle, VALHALLA_ADDR_DMA_START, 1);
 
-	spin_unlock_irqrestore(&mem->lock, flags);
+	spin_unlock_irqrestore(&bifrost->dma_chan_lock, flags);
 }
 
 static inline void *get_msi_data(void *p)
@@ -100,6 +106,35 @@ static irqreturn_t fvd_msi_handler(int irq, void *dev_id);
 
 static int msi_interrupts = 32;
 
+/*
+ * Interrupt coalescing state of an MSI vector, see BIFROST_IOCTL_IRQ_COALESCE
+ */
+struct msi_coalesce {
+	spinlock_t lock;
+	u32 max_count;		/* Zero if coalescing is disabled */
+	u64 window_ns;
+	u32 count;		/* Interrupts folded so far */
+	u64 first;
+	u64 last;
+	struct hrtimer timer;	/* Flushes folded interrupts after window */
+	struct bifrost_device *bifrost;
+	unsigned int vec;
+};
+
+static struct msi_coalesce msi_coalesce[32];
+
+/*
+ * Occurrence count of an MSI vector, see BIFROST_IOCTL_WAIT_IRQ
+ */
+struct msi_waiter {
+	wait_queue_head_t wq;
+	spinlock_t lock;
+	u64 count;		/* Interrupts since attach */
+	u64 last;		/* Time of last interrupt */
+};
+
+static struct msi_waiter msi_waiter[32];
+
 static struct msi_action msi[32] = {
 	MSI_ENABLE("dma0", dma_msi_handler, 0), /* MSI vector 0 */
 	MSI_ENABLE("dma1", dma_msi_handler, 0), /* MSI vector 1 */
@@ -246,6 +281,225 @@ static const struct attribute_group bifrost_groups = {
 };
 #endif
 
+/* Requires that the coalesce lock is held */
+static bool __flush_coalesced(struct msi_coalesce *c, struct bifrost_event *e)
+{
+	if (c->count == 0)
+		return false;
+
+	memset(e, 0, sizeof(*e));
+	e->type = BIFROST_EVENT_TYPE_IRQ;
+	e->data.irq.irq_source = map_msi_to_event(c->vec);
+	e->data.irq.count = c->count;
+	e->data.irq.first = c->first;
+	e->data.irq.last = c->last;
+	c->count = 0;
+	return true;
+}
+
+static enum hrtimer_restart coalesce_timeout(struct hrtimer *timer)
+{
+	struct msi_coalesce *c = container_of(timer, struct msi_coalesce, timer);
+	struct bifrost_event event;
+	unsigned long flags;
+	bool flush = false;
+
+	spin_lock_irqsave(&c->lock, flags);
+	/*
+	 * The window may have been flushed by coalesce_msi() while this ran
+	 * and a new one started, which has the timer armed again. Leave that
+	 * window to its own expiry.
+	 */
+	if (c->count && ktime_get_ns() - c->first >= c->window_ns)
+		flush = __flush_coalesced(c, &event);
+	spin_unlock_irqrestore(&c->lock, flags);
+
+	if (flush)
+		bifrost_create_event_at(c->bifrost, &event,
+					event.data.irq.last);
+
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Fold an interrupt into the coalescing state of its vector. Returns false
+ * if coalescing is disabled, i.e. caller shall create an event as usual.
+ */
+static bool coalesce_msi(struct msi_coalesce *c, u64 now)
+{
+	struct bifrost_event event;
+	unsigned long flags;
+	bool flush = false;
+
+	spin_lock_irqsave(&c->lock, flags);
+	if (c->max_count == 0) {
+		spin_unlock_irqrestore(&c->lock, flags);
+		return false;
+	}
+	if (c->count == 0) {
+		c->first = now;
+		hrtimer_start(&c->timer, ns_to_ktime(c->window_ns),
+			      HRTIMER_MODE_REL);
+	}
+	c->count++;
+	c->last = now;
+	if (c->count >= c->max_count) {
+		/*
+		 * If the timer is already running (-1) it waits for the lock
+		 * and then finds no expired window, see coalesce_timeout()
+		 */
+		hrtimer_try_to_cancel(&c->timer);
+		flush = __flush_coalesced(c, &event);
+	}
+	spin_unlock_irqrestore(&c->lock, flags);
+
+	if (flush)
+		bifrost_create_event_at(c->bifrost, &event,
+					event.data.irq.last);
+
+	return true;
+}
+
+/**
+ * Setup interrupt coalescing of an MSI vector. Interrupts already folded are
+ * flushed as an event when the setting changes.
+ *
+ * @param vec MSI vector.
+ * @param count Max number of interrupts per event, 0 or 1 disables.
+ * @param window_us Max time from first interrupt until event is created.
+ * @return 0 on success.
+ */
+int bifrost_set_irq_coalesce(unsigned int vec, u32 count, u32 window_us)
+{
+	struct msi_coalesce *c;
+	struct bifrost_event event;
+	unsigned long flags;
+	bool flush;
+
+	if (vec >= ARRAY_SIZE(msi))
+		return -EINVAL;
+	if (msi[vec].irq == NO_IRQ || msi[vec].handler != default_msi_handler)
+		return -ENODEV; /* Only plain event MSIs can be coalesced */
+	if (count > 1 && window_us == 0)
+		return -EINVAL;
+
+	c = &msi_coalesce[vec];
+	hrtimer_cancel(&c->timer);
+
+	spin_lock_irqsave(&c->lock, flags);
+	flush = __flush_coalesced(c, &event);
+	c->max_count = (count > 1) ? count : 0;
+	c->window_ns = (u64)window_us * NSEC_PER_USEC;
+	spin_unlock_irqrestore(&c->lock, flags);
+
+	if (flush)
+		bifrost_create_event_at(c->bifrost, &event,
+					event.data.irq.last);
+
+	return 0;
+}
+
+static void init_msi_coalesce(struct bifrost_device *bifrost)
+{
+	struct msi_coalesce *c;
+	int n;
+
+	for (n = 0; n < ARRAY_SIZE(msi_coalesce); n++) {
+		c = &msi_coalesce[n];
+		memset(c, 0, sizeof(*c));
+		spin_lock_init(&c->lock);
+		hrtimer_init(&c->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+		c->timer.function = coalesce_timeout;
+		c->bifrost = bifrost;
+		c->vec = n;
+	}
+}
+
+static void cleanup_msi_coalesce(void)
+{
+	int n;
+
+	for (n = 0; n < ARRAY_SIZE(msi_coalesce); n++) {
+		hrtimer_cancel(&msi_coalesce[n].timer);
+		msi_coalesce[n].max_count = 0;
+		msi_coalesce[n].count = 0;
+	}
+}
+
+static void signal_msi_waiters(struct msi_waiter *w, u64 now)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&w->lock, flags);
+	w->count++;
+	w->last = now;
+	spin_unlock_irqrestore(&w->lock, flags);
+
+	if (wq_has_sleeper(&w->wq))
+		wake_up_interruptible_all(&w->wq);
+}
+
+static bool msi_fired(struct msi_waiter *w, u64 seen, u64 *count, u64 *time)
+{
+	spin_lock_irq(&w->lock);
+	*count = w->count;
+	*time = w->last;
+	spin_unlock_irq(&w->lock);
+
+	return *count != seen;
+}
+
+/**
+ * Wait for an interrupt on an MSI vector. No event is created for the
+ * waiter, it only sleeps on the occurrence count of the vector.
+ *
+ * @param vec MSI vector.
+ * @param timeout_ms Max time to wait, zero doesn't wait.
+ * @param count In: last count seen by caller, zero waits for the next
+ *		interrupt. Out: number of interrupts since attach.
+ * @param time Returns CLOCK_MONOTONIC time of last interrupt in ns.
+ * @return 0 on success.
+ */
+int bifrost_wait_irq(unsigned int vec, u32 timeout_ms, u64 *count, u64 *time)
+{
+	struct msi_waiter *w;
+	u64 seen = *count;
+	long rc;
+
+	if (vec >= ARRAY_SIZE(msi))
+		return -EINVAL;
+	if (msi[vec].irq == NO_IRQ || msi[vec].handler != default_msi_handler)
+		return -ENODEV;
+
+	w = &msi_waiter[vec];
+	if (seen == 0)
+		msi_fired(w, 0, &seen, time);
+
+	rc = wait_event_interruptible_timeout(w->wq,
+					      msi_fired(w, seen, count, time),
+					      msecs_to_jiffies(timeout_ms));
+	if (rc < 0)
+		return rc;
+	if (rc == 0)
+		return -ETIMEDOUT;
+
+	return 0;
+}
+
+static void init_msi_waiters(void)
+{
+	struct msi_waiter *w;
+	int n;
+
+	for (n = 0; n < ARRAY_SIZE(msi_waiter); n++) {
+		w = &msi_waiter[n];
+		init_waitqueue_head(&w->wq);
+		spin_lock_init(&w->lock);
+		w->count = 0;
+		w->last = 0;
+	}
+}
+
 static int request_msi(struct msi_action *m, int hw_irq, int vec, void *data)
 {
 	/*
@@ -262,9 +516,12 @@ int bifrost_attach_msis_to_irq(int hw_irq, struct bifrost_device *bifrost)
 {
 	int n, v;
 
-	if (platform_fvd())
+	if (bifrost->platform->fvd)
 		memcpy(msi, msi_fvd, msi_interrupts * sizeof(struct msi_action));
 
+	init_msi_coalesce(bifrost);
+	init_msi_waiters();
+
 	for (n = 0; n < msi_interrupts; n++) {
 		if (msi[n].handler == NULL)
 			continue; /* No handler defined for this MSI */
@@ -293,6 +550,7 @@ void bifrost_detach_msis(void)
 			msi[n].irq = NO_IRQ;
 		}
 	}
+	cleanup_msi_coalesce();
 }
 
 int bifrost_dma_init(int irq, struct bifrost_device *bifrost)
@@ -301,17 +559,11 @@ int bifrost_dma_init(int irq, struct bifrost_device *bifrost)
 	struct device_memory *mem;
 	u32 val;
 
-	if (platform_rocky()) {
-		INFO("Rocky platform, Selecting bar 3\n");
-		bifrost->regb_dma = &bifrost->regb[3];
-	} else if (platform_evander() || platform_eoco() || platform_ec702()) {
-		INFO("Evander/Eoco platform, Selecting bar 2\n");
-		bifrost->regb_dma = &bifrost->regb[2];
-	} else {
-		INFO("Unknown platform, Selecting bar 0\n");
-		bifrost->regb_dma = &bifrost->regb[0];
-	}
+	INFO("%s platform, Selecting bar %d\n", bifrost->platform->name,
+	     bifrost->platform->dma_bar);
+	bifrost->regb_dma = &bifrost->regb[bifrost->platform->dma_bar];
 	mem = bifrost->regb_dma;
+	spin_lock_init(&bifrost->dma_chan_lock);
 
 	mem->rd(mem->handle, VALHALLA_ADDR_DMA_CAPABILITY, &val);
 	num_ch = val & 0xf;
@@ -396,11 +648,12 @@ static irqreturn_t dma_msi_handler(int irq, void *dev_id)
 
 	cookie = dma_done(bifrost->dma_ctl, irq, &ticket, &xfer_time, bifrost);
 	if (!IS_ERR(cookie)) {
+		memset(&event, 0, sizeof(event));
 		event.type = BIFROST_EVENT_TYPE_DMA_DONE;
 		event.data.dma.id = ticket;
 		event.data.dma.time = xfer_time;
 		event.data.dma.cookie = (u64)(unsigned long)cookie;
-		bifrost_create_event_in_atomic(bifrost, &event);
+		bifrost_create_event(bifrost, &event);
 	}
 
 	return IRQ_HANDLED;
@@ -411,13 +664,23 @@ static irqreturn_t default_msi_handler(int irq, void *dev_id)
 	struct bifrost_device *bifrost = get_msi_data(dev_id);
 	unsigned int vec = get_msi_vector(dev_id);
 	struct bifrost_event event;
+	u64 now = ktime_get_ns();
 
 	if (!bifrost)
 		return IRQ_NONE;
 
+	signal_msi_waiters(&msi_waiter[vec], now);
+
+	if (coalesce_msi(&msi_coalesce[vec], now))
+		return IRQ_HANDLED;
+
+	memset(&event, 0, sizeof(event));
 	event.type = BIFROST_EVENT_TYPE_IRQ;
-	event.data.irq_source = map_msi_to_event(vec);
-	bifrost_create_event_in_atomic(bifrost, &event);
+	event.data.irq.irq_source = map_msi_to_event(vec);
+	event.data.irq.count = 1;
+	event.data.irq.first = now;
+	event.data.irq.last = now;
+	bifrost_create_event_at(bifrost, &event, now);
 
 	return IRQ_HANDLED;
 }
@@ -513,6 +776,26 @@ static int read_device_memory(void *handle, u32 offset, u32 *value)
 	return 0;
 }
 
+static int read_range_device_memory(void *handle, u32 offset, u32 incr,
+				    u32 *values, u32 count)
+{
+	struct device_memory *mem = handle;
+	void __iomem *addr = mem->addr + offset;
+	u32 n;
+
+	/*
+	 * Not memcpy_fromio(), it may split the range into accesses narrower
+	 * than the 32-bit FPGA registers.
+	 */
+	if (incr == 0) {
+		ioread32_rep(addr, values, count);
+		return 0;
+	}
+	for (n = 0; n < count; n++, addr += incr)
+		values[n] = le32_to_cpu(ioread32(addr));
+	return 0;
+}
+
 static int set_mode_device_memory(void *handle, u32 offset, u32 mode)
 {
 	return 0; /* A no-op on HW */
@@ -532,6 +815,9 @@ static void init_device_memory(struct pci_dev *pci, int n,
 	mem->rd = read_device_memory;
 	mem->wr = write_device_memory;
 	mem->mset = set_mode_device_memory;
+	mem->rd_range = read_range_device_memory;
+	mem->stride = 4;
+	mem->rd_lockless = true;
 	spin_lock_init(&mem->lock);
 }
 
@@ -613,7 +899,7 @@ int bifrost_pci_probe_post_init(struct pci_dev *pdev)
 		goto err_dma;
 	}
 
-	if (platform_fvd() && bifrost_fvd_init(bdev) != 0)
+	if (bdev->platform->fvd && bifrost_fvd_init(bdev) != 0)
 		goto err_alloc;
 
 
@@ -663,8 +949,7 @@ int bifrost_pci_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 	}
 
 	/* Enable message signaled interrupts (MSI) */
-	if (platform_fvd())
-		msi_interrupts = 1;
+	msi_interrupts = bdev->platform->num_msi;
 #if KERNEL_VERSION(5, 4, 0) <= LINUX_VERSION_CODE
 	rc = pci_enable_msi(pdev);
 /* Could try this that should be more according to msi-howto.rst
@@ -700,9 +985,11 @@ int bifrost_pci_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 		goto err_pci_iomap_regb;
 
 	/*Patch BAR0 memory read/write functions to use 16 bit accesses*/
-	if (platform_fvd()) {
+	if (bdev->platform->regb0_16bit) {
 		bdev->regb[0].wr = membus_write_device_memory;
 		bdev->regb[0].rd = membus_read_device_memory;
+		bdev->regb[0].rd_range = membus_read_range_device_memory;
+		bdev->regb[0].stride = 1;
 	}
 
 	/* Run post init and make driver accessible */
@@ -717,6 +1004,11 @@ int bifrost_pci_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 		ALERT("failed to add sys fs entry\n");
 		goto err_pci_sysfs;
 	}
+	rc = sysfs_create_group(&pdev->dev.kobj, &bifrost_shadow_group);
+	if (rc) {
+		ALERT("failed to add sys fs entry\n");
+		goto err_pci_sysfs;
+	}
 #endif
 
 	bdev->pdev = pdev;
@@ -729,6 +1021,7 @@ int bifrost_pci_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 	/* stack-like cleanup on error */
 err_pci_sysfs:
 #if KERNEL_VERSION(3, 10, 0) <= LINUX_VERSION_CODE
+	sysfs_remove_group(&pdev->dev.kobj, &bifrost_shadow_group);
 	sysfs_remove_group(&pdev->dev.kobj, &bifrost_groups);
 #endif
 err_pci_post_init:
@@ -744,9 +1037,10 @@ err_pci_request:
 void bifrost_pci_remove(struct pci_dev *pdev)
 {
 	INFO("removing PCI\n");
-	if (platform_fvd())
+	if (bdev->platform->fvd)
 		bifrost_fvd_exit(bdev);
 #if KERNEL_VERSION(3, 10, 0) <= LINUX_VERSION_CODE
+	sysfs_remove_group(&pdev->dev.kobj, &bifrost_shadow_group);
 	sysfs_remove_group(&pdev->dev.kobj, &bifrost_groups);
 #endif
 	bifrost_detach_msis();
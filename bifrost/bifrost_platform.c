@@ -5,6 +5,85 @@
 #include <linux/version.h>
 #include "bifrost_platform.h"
 
+/* In normal PCI mode, user-space doesn't have write access to BAR0 */
+static const int user_space_bar_access[6] = {
+	RD_ACCESS | EV_ACCESS,		   /* BAR0 */
+	RD_ACCESS | WR_ACCESS | EV_ACCESS, /* BAR1 */
+	RD_ACCESS | WR_ACCESS | EV_ACCESS, /* BAR2 */
+	RD_ACCESS | WR_ACCESS | EV_ACCESS, /* BAR3 */
+	RD_ACCESS | WR_ACCESS | EV_ACCESS, /* BAR4 */
+	RD_ACCESS | WR_ACCESS | EV_ACCESS, /* BAR5 */
+};
+
+static const int user_space_bar_access_fvd[6] = {  /*used for */
+	RD_ACCESS | WR_ACCESS | EV_ACCESS, /* BAR0  fvd registers	*/
+	RD_ACCESS | WR_ACCESS | EV_ACCESS, /* BAR1  ddr memory window	*/
+	0, /* BAR2 */
+	RD_ACCESS | WR_ACCESS | EV_ACCESS, /* BAR3  dma engine control*/
+	0, /* BAR4 */
+	0, /* BAR5 */
+};
+
+/* In normal Membus mode, user-space doesn't have access to BAR2-5 */
+static const int user_space_membus_access[6] = {
+	RD_ACCESS | WR_ACCESS | EV_ACCESS, /* BAR0 */
+	RD_ACCESS | WR_ACCESS | EV_ACCESS, /* BAR1 */
+	0, /* BAR2 */
+	0, /* BAR3 */
+	0, /* BAR4 */
+	0, /* BAR5 */
+};
+
+static const struct bifrost_platform platform_desc_pci = {
+	.name = "PCIe",
+	.dma_bar = 0,
+	.num_msi = 32,
+	.bar_access = user_space_bar_access,
+};
+
+static const struct bifrost_platform platform_desc_membus = {
+	.name = "Membus",
+	.dma_bar = 0,
+	.num_msi = 32,
+	.bar_access = user_space_membus_access,
+};
+
+static const struct bifrost_platform platform_desc_rocky = {
+	.name = "Rocky",
+	.fvd = true,
+	.regb0_16bit = true,
+	.dma_bar = 3,
+	.num_msi = 1,
+	.bar_access = user_space_bar_access_fvd,
+};
+
+/* Evander, Eoco and EC702 */
+static const struct bifrost_platform platform_desc_evander = {
+	.name = "Evander/Eoco",
+	.fvd = true,
+	.regb0_16bit = true,
+	.dma_bar = 2,
+	.num_msi = 1,
+	.bar_access = user_space_bar_access_fvd,
+};
+
+/**
+ * Find out what platform the driver runs on.
+ *
+ * @param membus Set if the FPGA is connected with the memory bus.
+ * @return The platform description, never NULL.
+ */
+const struct bifrost_platform *bifrost_platform_probe(bool membus)
+{
+	if (platform_rocky())
+		return &platform_desc_rocky;
+	if (platform_fvd())
+		return &platform_desc_evander;
+	if (membus)
+		return &platform_desc_membus;
+	return &platform_desc_pci;
+}
+
 /* This version 5.4 is not exact - using dts information like this would
  * work also for earlier kernels
  */
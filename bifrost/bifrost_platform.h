@@ -7,6 +7,27 @@
 
 #include <linux/types.h>
 
+/* User space access rights to a BAR */
+#define NO_ACCESS 0
+#define RD_ACCESS 0x1 /* Read */
+#define WR_ACCESS 0x2 /* Write */
+#define EV_ACCESS 0x4 /* Events */
+
+/*
+ * Platform description, resolved once at init by bifrost_platform_probe()
+ * so that hot paths don't need to match the device tree.
+ */
+struct bifrost_platform {
+	const char *name;
+	bool fvd;		 /* FVD board, see bifrost_fvd_init() */
+	bool regb0_16bit;	 /* BAR0 registers are 16 bits wide */
+	int dma_bar;		 /* BAR of the Valhalla DMA registers */
+	unsigned int num_msi;	 /* MSI vectors to enable */
+	const int *bar_access;	 /* User space access rights of the 6 BARs */
+};
+
+extern const struct bifrost_platform *bifrost_platform_probe(bool membus);
+
 extern bool platform_fvd(void);
 extern bool platform_evander(void);
 extern bool platform_rocky(void);
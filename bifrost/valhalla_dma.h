@@ -37,6 +37,9 @@
 #define VALHALLA_ADDR_DMA_DIR_UP_STRM (VALHALLA_ADDR_DMA_REG_BASE + 0x24)
 #define VALHALLA_ADDR_DMA_START       (VALHALLA_ADDR_DMA_REG_BASE + 0x28)
 
+/* End of the DMA controller register block */
+#define VALHALLA_ADDR_DMA_REG_END     (VALHALLA_ADDR_DMA_REG_BASE + 0x30)
+
 /*
  * Possible VALHALLA_ADDR_DMA_DIR_UP_STRM register values
  *